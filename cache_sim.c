@@ -0,0 +1,489 @@
+// Replays a request trace against the server's cache without any sockets
+// or files, to see how big the cache should be and which policy to use.
+// It includes server_thread.c itself so every request goes through the
+// exact same server_fetch a worker uses, only the open and read are made
+// up from the trace. Build it with
+//
+//     gcc -O2 -pthread -o cache_sim cache_sim.c request.c common.c -lm
+//
+// A trace is one request per line: timestamp (seconds) file_name size.
+// Lines starting with # are skipped. -z makes a Zipf trace instead, the
+// same arguments always give the same trace, and -o saves it
+#include "server_thread.c"
+#include <getopt.h>
+#include <math.h>
+
+// One request in the trace
+struct sim_request
+{
+	double timestamp;
+	char *file_name;
+	int file_size;
+};
+
+// A Zipf trace's requests for a file all share its name, names has them
+// so they're only freed once. It's NULL when every request has its own
+struct sim_trace
+{
+	struct sim_request *requests;
+	long nr_requests;
+	long capacity;
+	char **names;
+	long nr_names;
+};
+
+// What one replay thread saw. server_fetch counts into stats, which is
+// where hits and coalesced requests are told apart from misses
+struct sim_thread
+{
+	pthread_t thread;
+	struct server *sv;
+	struct sim_trace *trace;
+	atomic_long *next;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long bytes_requested;
+	unsigned long bytes_hit;
+	struct histogram hit_time;
+	struct histogram miss_time;
+	struct server_stats stats;
+};
+
+// Every "open" file is a copy of /dev/null so server_fetch can close it
+static int sim_null_fd;
+
+void usage()
+{
+	fprintf(stderr, "Usage: cache_sim [-t trace | -z files,requests,alpha,seed] [-o trace_out]\n"
+					"                 [-s size,size,...] [-j threads,threads,...] [-p policy]\n"
+					"Sizes can end in K, M or G. The policy is lru, clock, gdsf or tinylfu\n");
+	exit(1);
+}
+
+static void
+trace_add(struct sim_trace *trace, double timestamp, char *file_name, int file_size)
+{
+	if (trace->nr_requests == trace->capacity)
+	{
+		trace->capacity = trace->capacity > 0 ? trace->capacity * 2 : 1024;
+		trace->requests = (struct sim_request *)realloc(trace->requests, sizeof(struct sim_request) * trace->capacity);
+	}
+	trace->requests[trace->nr_requests].timestamp = timestamp;
+	trace->requests[trace->nr_requests].file_name = file_name;
+	trace->requests[trace->nr_requests].file_size = file_size;
+	trace->nr_requests++;
+}
+
+// Read a trace file, every line is: timestamp file_name size
+static void
+trace_read(struct sim_trace *trace, const char *path)
+{
+	char line[PATH_MAX + 64];
+	char file_name[PATH_MAX];
+	FILE *in = fopen(path, "r");
+	long line_nr = 0;
+
+	if (in == NULL)
+	{
+		fprintf(stderr, "cache_sim: can't open %s\n", path);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL)
+	{
+		double timestamp;
+		long file_size;
+
+		line_nr++;
+		if (line[0] == '#' || line[0] == '\n')
+		{
+			continue;
+		}
+		if (sscanf(line, "%lf %4095s %ld", &timestamp, file_name, &file_size) != 3 ||
+			file_size < 0 || file_size > INT_MAX)
+		{
+			fprintf(stderr, "cache_sim: %s:%ld: bad request\n", path, line_nr);
+			exit(1);
+		}
+		trace_add(trace, timestamp, strdup(file_name), file_size);
+	}
+	fclose(in);
+}
+
+// splitmix64, small and good enough that seeds give the same trace everywhere
+static unsigned long
+sim_random(unsigned long *state)
+{
+	unsigned long z = (*state += 0x9E3779B97F4A7C15ul);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ul;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBul;
+	return z ^ (z >> 31);
+}
+
+// Uniform in (0, 1)
+static double
+sim_uniform(unsigned long *state)
+{
+	return ((sim_random(state) >> 11) + 0.5) / (double)(1ul << 53);
+}
+
+// Zipf popularity over nr_files files with log-normal sizes (median about
+// 2KB, so most are small but some are huge) and Poisson arrivals averaging
+// 1000 requests a second
+static void
+trace_zipf(struct sim_trace *trace, long nr_files, long nr_requests, double alpha, unsigned long seed)
+{
+	double *cdf = (double *)malloc(sizeof(double) * nr_files);
+	char **names = (char **)malloc(sizeof(char *) * nr_files);
+	int *sizes = (int *)malloc(sizeof(int) * nr_files);
+	unsigned long state = seed;
+	double total = 0;
+	double now = 0;
+
+	for (long i = 0; i < nr_files; i++)
+	{
+		char name[32];
+
+		total += 1.0 / pow(i + 1, alpha);
+		cdf[i] = total;
+
+		// Box-Muller for the size, which has nothing to do with popularity
+		double normal = sqrt(-2 * log(sim_uniform(&state))) * cos(2 * M_PI * sim_uniform(&state));
+		double size = exp(7.6 + 1.8 * normal);
+		sizes[i] = size < 16 ? 16 : size > (64 << 20) ? (64 << 20) : (int)size;
+
+		snprintf(name, sizeof(name), "zipf/f%07ld", i);
+		names[i] = strdup(name);
+	}
+
+	for (long i = 0; i < nr_requests; i++)
+	{
+		double wanted = sim_uniform(&state) * total;
+		long low = 0;
+		long high = nr_files - 1;
+
+		// First file whose cdf reaches wanted
+		while (low < high)
+		{
+			long middle = (low + high) / 2;
+			if (cdf[middle] < wanted)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+
+		now += -log(sim_uniform(&state)) / 1000;
+		trace_add(trace, now, names[low], sizes[low]);
+	}
+
+	free(cdf);
+	free(sizes);
+	trace->names = names;
+	trace->nr_names = nr_files;
+}
+
+static void
+trace_free(struct sim_trace *trace)
+{
+	if (trace->names != NULL)
+	{
+		for (long i = 0; i < trace->nr_names; i++)
+		{
+			free(trace->names[i]);
+		}
+		free(trace->names);
+	}
+	else
+	{
+		for (long i = 0; i < trace->nr_requests; i++)
+		{
+			free(trace->requests[i].file_name);
+		}
+	}
+	free(trace->requests);
+}
+
+static void
+trace_write(struct sim_trace *trace, const char *path)
+{
+	FILE *out = fopen(path, "w");
+
+	if (out == NULL)
+	{
+		fprintf(stderr, "cache_sim: can't write %s\n", path);
+		exit(1);
+	}
+	fprintf(out, "# timestamp file_name size\n");
+	for (long i = 0; i < trace->nr_requests; i++)
+	{
+		struct sim_request *request = &trace->requests[i];
+		fprintf(out, "%.6f %s %d\n", request->timestamp, request->file_name, request->file_size);
+	}
+	fclose(out);
+}
+
+// Open a file from the trace, data->file_size is already its size
+static int
+sim_openfile(struct file_data *data, struct stat *st)
+{
+	if (st != NULL)
+	{
+		memset(st, 0, sizeof(struct stat));
+		st->st_mode = S_IFREG;
+		st->st_size = data->file_size;
+	}
+	return dup(sim_null_fd);
+}
+
+// Reading is free, what's in the buffer doesn't matter
+static int
+sim_readfile(int fd, struct file_data *data)
+{
+	(void)fd;
+	(void)data;
+	return 1;
+}
+
+// One request through server_fetch, the way a worker does it minus the
+// sending. Waiting for another thread to read the file in isn't a hit
+static void
+sim_request(struct sim_thread *self, struct sim_request *request)
+{
+	struct file_data data = {request->file_name, NULL, request->file_size};
+	unsigned long hits = self->stats.hits;
+	unsigned long coalesced = self->stats.coalesced;
+	struct wc_item *cached_file;
+	int fd;
+	long start = now_ns();
+
+	self->bytes_requested += request->file_size;
+	if (server_fetch(self->sv, &data, &cached_file, &fd) == FETCH_STREAM)
+	{
+		close(fd);
+	}
+	server_fetch_done(self->sv, &data, cached_file);
+
+	if (self->stats.hits > hits && self->stats.coalesced == coalesced)
+	{
+		self->hits++;
+		self->bytes_hit += request->file_size;
+		histogram_record(&self->hit_time, now_ns() - start);
+	}
+	else
+	{
+		self->misses++;
+		histogram_record(&self->miss_time, now_ns() - start);
+	}
+}
+
+static void
+sim_thread_function(struct sim_thread *self)
+{
+	long i;
+
+	thread_stats = &self->stats;
+	while ((i = atomic_fetch_add_explicit(self->next, 1, memory_order_relaxed)) < self->trace->nr_requests)
+	{
+		sim_request(self, &self->trace->requests[i]);
+	}
+}
+
+// Replay the whole trace against an empty cache of cache_size bytes
+static void
+sim_run(struct sim_trace *trace, long cache_size, int nr_threads)
+{
+	struct server *sv = server_init(0, 0, cache_size);
+	struct sim_thread *threads = (struct sim_thread *)aligned_alloc(64, sizeof(struct sim_thread) * nr_threads);
+	struct sim_thread *total = (struct sim_thread *)aligned_alloc(64, sizeof(struct sim_thread));
+	atomic_long next;
+	unsigned long evictions = 0;
+
+	sv->open_file = sim_openfile;
+	sv->read_file = sim_readfile;
+	atomic_init(&next, 0);
+	memset(threads, 0, sizeof(struct sim_thread) * nr_threads);
+	memset(total, 0, sizeof(struct sim_thread));
+
+	long start = now_ns();
+	for (int i = 0; i < nr_threads; i++)
+	{
+		threads[i].sv = sv;
+		threads[i].trace = trace;
+		threads[i].next = &next;
+		pthread_create(&threads[i].thread, NULL, (void *)&sim_thread_function, &threads[i]);
+	}
+	for (int i = 0; i < nr_threads; i++)
+	{
+		pthread_join(threads[i].thread, NULL);
+		total->hits += threads[i].hits;
+		total->misses += threads[i].misses;
+		total->stats.coalesced += threads[i].stats.coalesced;
+		total->bytes_requested += threads[i].bytes_requested;
+		total->bytes_hit += threads[i].bytes_hit;
+		histogram_add(&total->hit_time, &threads[i].hit_time);
+		histogram_add(&total->miss_time, &threads[i].miss_time);
+	}
+	double seconds = (now_ns() - start) / 1e9;
+
+	for (int i = 0; i < sv->nr_shards; i++)
+	{
+		for (int j = 0; j < CACHE_TIERS; j++)
+		{
+			evictions += sv->cache[i].tiers[j].evictions;
+		}
+	}
+
+	printf("%-8s %10ld %7d %6.2f%% %6.2f%% %10lu %8lu %10.0f %8lu %8lu %8lu %8lu\n",
+		   sv->policy->name, cache_size, nr_threads,
+		   trace->nr_requests > 0 ? 100.0 * total->hits / trace->nr_requests : 0.0,
+		   total->bytes_requested > 0 ? 100.0 * total->bytes_hit / total->bytes_requested : 0.0,
+		   evictions, total->stats.coalesced, trace->nr_requests / seconds,
+		   histogram_percentile(&total->hit_time, 50), histogram_percentile(&total->hit_time, 99),
+		   histogram_percentile(&total->miss_time, 50), histogram_percentile(&total->miss_time, 99));
+	fflush(stdout);
+
+	free(total);
+	free(threads);
+	server_exit(sv);
+}
+
+// A comma separated list of numbers, sizes can end in K, M or G
+static int
+parse_list(char *arg, long *values, int max)
+{
+	int count = 0;
+
+	for (char *item = strtok(arg, ","); item != NULL; item = strtok(NULL, ","))
+	{
+		char *end;
+		long value = strtol(item, &end, 10);
+
+		switch (*end)
+		{
+		case 'G':
+		case 'g':
+			value <<= 10;
+			// fall through
+		case 'M':
+		case 'm':
+			value <<= 10;
+			// fall through
+		case 'K':
+		case 'k':
+			value <<= 10;
+			end++;
+			break;
+		}
+		if (*end != '\0' || value <= 0 || count == max)
+		{
+			usage();
+		}
+		values[count++] = value;
+	}
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim_trace trace = {NULL, 0, 0, NULL, 0};
+	long sizes[64] = {1 << 20, 4 << 20, 16 << 20, 64 << 20};
+	long threads[64] = {1};
+	int nr_sizes = 4;
+	int nr_threads = 1;
+	char *trace_in = NULL;
+	char *trace_out = NULL;
+	char *zipf = NULL;
+	int option;
+
+	while ((option = getopt(argc, argv, "t:z:o:s:j:p:")) != -1)
+	{
+		switch (option)
+		{
+		case 't':
+			trace_in = optarg;
+			break;
+		case 'z':
+			zipf = optarg;
+			break;
+		case 'o':
+			trace_out = optarg;
+			break;
+		case 's':
+			nr_sizes = parse_list(optarg, sizes, 64);
+			break;
+		case 'j':
+			nr_threads = parse_list(optarg, threads, 64);
+			break;
+		case 'p':
+			setenv("SERVER_CACHE_POLICY", optarg, 1);
+			break;
+		default:
+			usage();
+		}
+	}
+	if ((trace_in == NULL) == (zipf == NULL) || optind != argc)
+	{
+		usage();
+	}
+
+	if (trace_in != NULL)
+	{
+		trace_read(&trace, trace_in);
+	}
+	else
+	{
+		long nr_files;
+		long nr_requests;
+		double alpha;
+		unsigned long seed;
+
+		if (sscanf(zipf, "%ld,%ld,%lf,%lu", &nr_files, &nr_requests, &alpha, &seed) != 4 ||
+			nr_files <= 0 || nr_requests < 0 || alpha < 0)
+		{
+			usage();
+		}
+		trace_zipf(&trace, nr_files, nr_requests, alpha, seed);
+	}
+	if (trace_out != NULL)
+	{
+		trace_write(&trace, trace_out);
+	}
+
+	// Nothing but the cache: no watcher, no looking at the (made up) files
+	// again, no snapshot and no event loops
+	setenv("SERVER_CACHE_WATCH", "0", 1);
+	setenv("SERVER_CACHE_REVALIDATE_MS", "0", 1);
+	setenv("SERVER_CACHE_SNAPSHOT", "", 1);
+	setenv("SERVER_EVENT_LOOPS", "0", 1);
+	sim_null_fd = open("/dev/null", O_RDONLY);
+	if (sim_null_fd < 0)
+	{
+		fprintf(stderr, "cache_sim: can't open /dev/null\n");
+		exit(1);
+	}
+
+	printf("%-8s %10s %7s %7s %7s %10s %8s %10s %8s %8s %8s %8s\n",
+		   "policy", "cache", "threads", "hits", "bytes", "evictions", "coalesce", "req/s",
+		   "hit50ns", "hit99ns", "miss50ns", "miss99ns");
+	for (int i = 0; i < nr_sizes; i++)
+	{
+		for (int j = 0; j < nr_threads; j++)
+		{
+			if (sizes[i] > INT_MAX)
+			{
+				usage();
+			}
+			sim_run(&trace, sizes[i], threads[j]);
+		}
+	}
+
+	close(sim_null_fd);
+	trace_free(&trace);
+	return 0;
+}
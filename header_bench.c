@@ -0,0 +1,173 @@
+// Times the two ways a worker can send a cache hit: formatting the header
+// and writing it and the file separately like request_sendfile does, or
+// one writev of the header stored with the cached file (request_sendcached).
+// Like cache_sim it includes server_thread.c so both go through the server's
+// own code. Each is timed writing to /dev/null, where only the formatting
+// and the syscalls count, and to a unix socket drained by another thread.
+// Build it with
+//
+//     gcc -O2 -pthread -o header_bench header_bench.c request.c common.c
+//
+// and run it with -f file_size -n hits, both optional
+#include "server_thread.c"
+#include <getopt.h>
+#include <sys/socket.h>
+
+// Every "open" file is a copy of /dev/null so server_fetch can close it
+static int bench_null_fd;
+
+void usage()
+{
+	fprintf(stderr, "Usage: header_bench [-f file_size] [-n hits]\n");
+	exit(1);
+}
+
+static int
+bench_openfile(struct file_data *data, struct stat *st)
+{
+	if (st != NULL)
+	{
+		memset(st, 0, sizeof(struct stat));
+		st->st_mode = S_IFREG;
+		st->st_size = data->file_size;
+	}
+	return dup(bench_null_fd);
+}
+
+// The file is all x's
+static int
+bench_readfile(int fd, struct file_data *data)
+{
+	(void)fd;
+	memset(data->file_buf, 'x', data->file_size);
+	return 1;
+}
+
+// Throw away whatever comes out of the other end of the socket
+static void
+bench_drain(int *fd)
+{
+	char buf[65536];
+
+	while (read(*fd, buf, sizeof(buf)) > 0)
+	{
+	}
+}
+
+// The hit the way request_sendfile sends it
+static void
+bench_formatted(int connfd, struct wc_item *cached)
+{
+	char header[RESPONSE_HEADER_MAX];
+
+	write_fully(connfd, header, response_header(header, sizeof(header), cached->data, false));
+	write_fully(connfd, cached->data->file_buf, cached->data->file_size);
+}
+
+// Nanoseconds a hit takes on average, sent nr_hits times
+static double
+bench_time(int connfd, struct wc_item *cached, long nr_hits, bool stored)
+{
+	long start = now_ns();
+
+	for (long i = 0; i < nr_hits; i++)
+	{
+		if (stored)
+		{
+			request_sendcached(connfd, cached);
+		}
+		else
+		{
+			bench_formatted(connfd, cached);
+		}
+	}
+	return (double)(now_ns() - start) / nr_hits;
+}
+
+int main(int argc, char *argv[])
+{
+	long file_size = 12000;
+	long nr_hits = 1000000;
+	int option;
+
+	while ((option = getopt(argc, argv, "f:n:")) != -1)
+	{
+		switch (option)
+		{
+		case 'f':
+			file_size = atol(optarg);
+			break;
+		case 'n':
+			nr_hits = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (file_size < 1 || file_size > (64 << 20) || nr_hits < 1 || optind != argc)
+	{
+		usage();
+	}
+
+	// Just the cache, with room for the one file
+	setenv("SERVER_CACHE_SHARDS", "1", 1);
+	setenv("SERVER_CACHE_WATCH", "0", 1);
+	setenv("SERVER_CACHE_REVALIDATE_MS", "0", 1);
+	setenv("SERVER_CACHE_SNAPSHOT", "", 1);
+	setenv("SERVER_EVENT_LOOPS", "0", 1);
+	setenv("SERVER_CACHE_SMALL_PERCENT", "0", 1);
+	bench_null_fd = open("/dev/null", O_WRONLY);
+	if (bench_null_fd < 0)
+	{
+		fprintf(stderr, "header_bench: can't open /dev/null\n");
+		exit(1);
+	}
+	struct server *sv = server_init(0, 0, file_size * 2 + (1 << 20));
+	sv->open_file = bench_openfile;
+	sv->read_file = bench_readfile;
+
+	// Once to read it in, then again to get it as a hit
+	struct file_data data = {"bench.html", NULL, (int)file_size};
+	struct wc_item *cached;
+	int fd;
+	for (int i = 0; i < 2; i++)
+	{
+		if (server_fetch(sv, &data, &cached, &fd) == FETCH_STREAM)
+		{
+			close(fd);
+		}
+		if (i == 0)
+		{
+			server_fetch_done(sv, &data, cached);
+		}
+	}
+	if (cached == NULL)
+	{
+		fprintf(stderr, "header_bench: the file didn't go in the cache\n");
+		exit(1);
+	}
+
+	int sockets[2];
+	pthread_t drain;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0)
+	{
+		fprintf(stderr, "header_bench: can't make a socket\n");
+		exit(1);
+	}
+	pthread_create(&drain, NULL, (void *)&bench_drain, &sockets[1]);
+
+	printf("file %ldB hits %ld\n", file_size, nr_hits);
+	printf("%-8s %12s %12s\n", "to", "formatted", "stored");
+	printf("%-8s %9.0fns %9.0fns\n", "devnull", bench_time(bench_null_fd, cached, nr_hits, false),
+		   bench_time(bench_null_fd, cached, nr_hits, true));
+	printf("%-8s %9.0fns %9.0fns\n", "socket", bench_time(sockets[0], cached, nr_hits, false),
+		   bench_time(sockets[0], cached, nr_hits, true));
+
+	close(sockets[0]);
+	pthread_join(drain, NULL);
+	close(sockets[1]);
+	server_fetch_done(sv, &data, cached);
+	server_exit(sv);
+	close(bench_null_fd);
+	return 0;
+}
@@ -1,52 +1,836 @@
+#define _GNU_SOURCE
 #include "request.h"
 #include "server_thread.h"
 #include "common.h"
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// Number of independently locked cache shards, can be overridden
+// at run time with the SERVER_CACHE_SHARDS environment variable
+#ifndef CACHE_SHARDS
+#define CACHE_SHARDS 16
+#endif
+
+// Replacement policy used by every shard, can be overridden at run time
+// with SERVER_CACHE_POLICY set to lru, clock, gdsf or tinylfu
+#ifndef CACHE_POLICY
+#define CACHE_POLICY "lru"
+#endif
+
+// Every shard's index starts this big and doubles when it's 7/8 full,
+// moving this many old buckets over on every insert or delete
+#define INDEX_MIN_SLOTS 64
+#define INDEX_MIGRATE_STEP 16
+
+// Marks a bucket in an old index that has been moved or deleted
+#define INDEX_TOMBSTONE ((struct wc_item *)1)
+
+// Files up to CACHE_SMALL_MAX bytes go in each shard's small tier, stored
+// right after their entry in one allocation, and get CACHE_SMALL_PERCENT of
+// the shard's budget to themselves so big files can't push them out. Can be
+// overridden at run time with SERVER_CACHE_SMALL_MAX and
+// SERVER_CACHE_SMALL_PERCENT, a percent of 0 puts every file in one tier
+#ifndef CACHE_SMALL_MAX
+#define CACHE_SMALL_MAX 4096
+#endif
+#ifndef CACHE_SMALL_PERCENT
+#define CACHE_SMALL_PERCENT 25
+#endif
+#define TIER_SMALL 0
+#define TIER_LARGE 1
+#define CACHE_TIERS 2
+
+// Don't carve the cache into shards smaller than this, otherwise
+// normal sized files would stop fitting into a single shard
+#ifndef CACHE_SHARD_MIN_SIZE
+#define CACHE_SHARD_MIN_SIZE (1 << 20)
+#endif
+
+// Cache entries and files up to SLAB_MAX_OBJECT bytes are carved out of
+// SLAB_SIZE slabs holding one size class each, size classes go up by
+// half a power of two from SLAB_MIN_OBJECT. Anything bigger gets its
+// own mapping. Slabs are kept small since every class in use has one
+// partly empty
+#define SLAB_SIZE (1ul << 16)
+#define SLAB_MIN_OBJECT 64ul
+#define SLAB_MAX_OBJECT (1ul << 13)
+#define SLAB_CLASSES 15
+
+// Mappings up to EXTENT_MAX_OBJECT are rounded up to a size class of their
+// own (half powers of two above SLAB_MAX_OBJECT) and freed ones are kept for
+// the next buffer of that class, up to ARENA_POOL_BYTES per arena, so
+// churning through mid sized files doesn't mmap and munmap every time.
+// Bigger ones go straight back to the system when they're freed
+#define EXTENT_MAX_OBJECT (1ul << 20)
+#define EXTENT_CLASSES 14
+#ifndef ARENA_POOL_BYTES
+#define ARENA_POOL_BYTES (8l << 20)
+#endif
+
+// Room for a cached file's response header, the longest file type
+// and a ten digit length fit with some to spare
+#define RESPONSE_HEADER_MAX 128
+
+// Number of event loop threads owning connections, 0 means every request
+// is handled start to finish by a worker. Can be overridden at run time
+// with the SERVER_EVENT_LOOPS environment variable
+#ifndef EVENT_LOOPS
+#define EVENT_LOOPS 0
+#endif
+
+// Most requests a worker takes from its queue at once, can be
+// overridden at run time with SERVER_WORKER_BATCH
+#ifndef WORKER_BATCH
+#define WORKER_BATCH 8
+#endif
+#define WORKER_BATCH_MAX 64
+
+// The worker pool runs between SERVER_MIN_THREADS and nr_threads workers.
+// It grows when the last request in line would wait longer than
+// POOL_TARGET_WAIT_US for a worker going by the measured service time,
+// and a worker that's been idle for POOL_IDLE_MS retires. Both can be
+// overridden with SERVER_POOL_TARGET_WAIT_US and SERVER_POOL_IDLE_MS
+#ifndef POOL_TARGET_WAIT_US
+#define POOL_TARGET_WAIT_US 1000
+#endif
+#ifndef POOL_IDLE_MS
+#define POOL_IDLE_MS 5000
+#endif
+
+// Most events an event loop handles per epoll_wait
+#define EVENT_BATCH 64
+
+// File server_exit saves the cache to and server_init restores it from,
+// can be set at run time with SERVER_CACHE_SNAPSHOT. Empty means don't
+#ifndef CACHE_SNAPSHOT
+#define CACHE_SNAPSHOT ""
+#endif
+
+// Watch the directories cached files are in and drop files as they change,
+// can be turned off at run time with SERVER_CACHE_WATCH=0. Without the
+// watcher a cached file hit CACHE_REVALIDATE_MS after it was last compared
+// with the one on disk gets compared again (one stat), the watcher only
+// falls back on that when it runs out of watches. SERVER_CACHE_REVALIDATE_MS
+// sets it either way, 0 means only compare when the watcher asks
+#ifndef CACHE_WATCH
+#define CACHE_WATCH 1
+#endif
+#ifndef CACHE_REVALIDATE_MS
+#define CACHE_REVALIDATE_MS 1000
+#endif
+// How many watched directories the watcher remembers without a lock
+#ifndef CACHE_WATCH_KNOWN
+#define CACHE_WATCH_KNOWN 1024
+#endif
+#define CACHE_WATCH_EVENTS (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | \
+							IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Files that can't be opened are remembered for NEGATIVE_TTL_MS so asking
+// again gets a 404 without going to the disk. At most NEGATIVE_ENTRIES are
+// kept across all shards, 0 turns it off. Can be overridden at run time
+// with SERVER_NEGATIVE_TTL_MS and SERVER_NEGATIVE_ENTRIES
+#ifndef NEGATIVE_TTL_MS
+#define NEGATIVE_TTL_MS 1000
+#endif
+#ifndef NEGATIVE_ENTRIES
+#define NEGATIVE_ENTRIES 4096
+#endif
+
+// Let event loops read missed files themselves with io_uring instead of
+// handing them to a worker, can be overridden at run time with the
+// SERVER_IO_URING environment variable. Loops fall back to the workers
+// when io_uring isn't there
+#ifndef IO_URING
+#define IO_URING 0
+#endif
+
+// Most file reads one event loop keeps in flight
+#ifndef IO_URING_DEPTH
+#define IO_URING_DEPTH 256
+#endif
+
+// Order workers take requests in, fifo or sjf (shortest job first). sjf
+// looks up the size of the file each request wants as it's queued and
+// serves smaller ones first, every byte counting as SCHEDULER_NS_PER_BYTE
+// of having waited and files that aren't cached as SCHEDULER_MISS_SIZE
+// bytes. Nothing queued more than SCHEDULER_MAX_WAIT_US after a request
+// goes ahead of it so big files still get served. Can be overridden at
+// run time with SERVER_SCHEDULER and SERVER_SCHEDULER_MAX_WAIT_US
+#ifndef SCHEDULER
+#define SCHEDULER "fifo"
+#endif
+#ifndef SCHEDULER_MAX_WAIT_US
+#define SCHEDULER_MAX_WAIT_US 10000
+#endif
+#define SCHEDULER_NS_PER_BYTE 1
+#define SCHEDULER_MISS_SIZE 65536l
+
+// Where workers and event loops run, none, node or core. node keeps thread
+// i on the cpus of NUMA node i % nodes, core pins it to one of them. Either
+// way shard i's memory comes from the same node as thread i, and a request
+// for a file goes to a worker on its shard's node when the name is known.
+// Can be overridden at run time with SERVER_AFFINITY
+#ifndef AFFINITY
+#define AFFINITY "none"
+#endif
+#define AFFINITY_NONE 0
+#define AFFINITY_NODE 1
+#define AFFINITY_CORE 2
+#define NUMA_MAX_NODES 1024
+
+// What server_request does when max_requests are already queued, block
+// or shed. block waits for room so nothing gets accepted meanwhile, shed
+// answers the new connections with a 503 right away. Requests that waited
+// longer than QUEUE_DEADLINE_MS for a worker get a 503 too instead of being
+// served late, 0 means they never do. Can be overridden at run time with
+// SERVER_ADMISSION and SERVER_QUEUE_DEADLINE_MS
+#ifndef ADMISSION
+#define ADMISSION "block"
+#endif
+#ifndef QUEUE_DEADLINE_MS
+#define QUEUE_DEADLINE_MS 0
+#endif
+
+// Event loops keep a connection open for up to KEEPALIVE_REQUESTS requests
+// when the client wants it to, answering pipelined requests in order. A
+// connection that's been waiting KEEPALIVE_IDLE_MS for a whole request is
+// closed, 0 means never. Can be overridden at run time with
+// SERVER_KEEPALIVE_REQUESTS (1 turns keep alive off) and SERVER_KEEPALIVE_IDLE_MS
+#ifndef KEEPALIVE_REQUESTS
+#define KEEPALIVE_REQUESTS 100
+#endif
+#ifndef KEEPALIVE_IDLE_MS
+#define KEEPALIVE_IDLE_MS 5000
+#endif
+
+// SERVER_STATS_SIGNAL=1 starts a thread that dumps the stats on SIGUSR1, the
+// owner has to block SIGUSR1 in its own threads or the signal still kills it
+#ifndef STATS_SIGNAL
+#define STATS_SIGNAL 0
+#endif
 
 //~~~~~ Added Functions ~~~~~
-void stub_function(struct server *sv);
+struct worker;
+struct connection;
+struct event_loop;
+void stub_function(struct worker *self);
+void server_request_batch(struct server *sv, int *connfds, int nr_requests);
+void event_loop_function(struct event_loop *loop);
+void server_stats_dump(struct server *sv, FILE *out);
+void stats_function(struct server *sv);
 
-struct wc_item
+// A queued request and when it was queued. Requests from an event loop
+// only need the file read, conn is the connection to hand it back to.
+// key is where it goes in shortest job first order
+struct work_item
 {
-	// Hash key
-	char *key;
+	int connfd;
+	long queued_at;
+	struct connection *conn;
+	long key;
+};
+
+// What server_fetch found for a file
+enum fetch_result
+{
+	// Holds a reference to the cached file
+	FETCH_CACHED,
+	// data->file_buf is a private copy from the shard's arena
+	FETCH_COPY,
+	// The file is open and should be streamed
+	FETCH_STREAM,
+	// The file isn't there, can't be read by us, or couldn't be opened
+	// or read for any other reason
+	FETCH_MISSING,
+	FETCH_FORBIDDEN,
+	FETCH_FAILED,
+	// The file is known to be missing, nothing was asked of the disk
+	FETCH_NEGATIVE,
+	// Not fetched at all, the server was too busy to get to it in time
+	FETCH_OVERLOADED,
+};
+
+enum connection_state
+{
+	CONN_READING,
+	CONN_FETCHING,
+	CONN_WRITING,
+};
+
+// A client connection owned by an event loop. The loop reads the request
+// and writes the response without blocking, a worker only reads the file
+struct connection
+{
+	int fd;
+	enum connection_state state;
+	struct event_loop *loop;
+
+	// Next on the loop's incoming, finished or backlog list, or on the
+	// list of connections parked on a file someone else is loading
+	struct connection *next;
+
+	// Neighbours on the loop's list of all its connections
+	struct connection *conn_prev;
+	struct connection *conn_next;
+
+	// What's been read so far, the request being answered is the first
+	// request_end bytes and anything after that is the next one
+	char request[MAXLINE];
+	size_t request_len;
+	size_t request_end;
+
+	// Keep the connection open after this response, how many responses
+	// it's had, and its place on the loop's idle list while it waits
+	// for a request (idle_since is 0 when it isn't on it)
+	bool keep_alive;
+	int served;
+	long idle_since;
+	struct connection *idle_prev;
+	struct connection *idle_next;
+
+	// What the worker found for the file
+	struct file_data data;
+	enum fetch_result fetched;
+	struct wc_item *cached;
+	int file_fd;
+
+	// A read the loop has in flight itself, with the placeholder it's
+	// loading into the cache, or the one it's parked on
+	struct wc_item *loading;
+	struct wc_item *parked_on;
+	size_t read_done;
+	long read_start;
+
+	// The response is the header then either body or file_fd
+	char header[MAXLINE];
+	size_t header_len;
+	const char *body;
+	size_t body_len;
+	size_t sent;
+	long start;
+};
+
+// Just enough of an io_uring for reading files, set up with raw syscalls
+// so there's no dependency on liburing
+struct uring
+{
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring_map;
+	size_t ring_map_size;
+	size_t sqes_size;
+
+	// Our copy of the submission tail, entries queued but not taken by
+	// the kernel yet, and taken but not completed
+	unsigned int tail;
+	unsigned int pending;
+	unsigned int in_flight;
+	unsigned int depth;
+};
+
+// An event loop thread and the connections it owns. server_request and
+// workers hand it connections through lock free stacks and then poke wakefd
+struct event_loop
+{
+	pthread_t thread;
+	int id;
+	struct server *sv;
+	int epfd;
+	int wakefd;
+
+	_Alignas(64) _Atomic(struct connection *) incoming;
+	_Alignas(64) _Atomic(struct connection *) finished;
+
+	// Only touched by the loop itself: connections waiting for room in
+	// the worker queues and every connection it owns
+	_Alignas(64) struct connection *backlog;
+	struct connection *backlog_tail;
+	struct connection *connections;
+	int nr_connections;
+
+	// Connections waiting for a request, longest waiting first, and
+	// ones that already have their next request read in
+	struct connection *idle_head;
+	struct connection *idle_tail;
+	struct connection *pipelined;
+
+	// File reads the loop does itself, fd is -1 if it hands them to workers
+	struct uring ring;
+} __attribute__((aligned(64)));
+
+void event_loop_add(struct server *sv, int connfd);
+void event_loop_push(struct event_loop *loop, _Atomic(struct connection *) *stack, struct connection *conn);
+void event_fetch(struct server *sv, struct connection *conn);
+int uring_init(struct uring *ring, unsigned int depth);
+void uring_destroy(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+void uring_submit(struct uring *ring);
+bool uring_next_cqe(struct uring *ring, struct io_uring_cqe *cqe);
+
+// One slot of the request ring, seq says whose turn it is to use the slot:
+// seq == 2 * pos means free for the producer at pos, seq == 2 * pos + 1
+// means filled for the consumer at pos. Doubling keeps the two apart even
+// when the ring only has a single slot
+struct ring_slot
+{
+	atomic_size_t seq;
+	struct work_item item;
+};
+
+// Bounded multi producer / multi consumer ring of requests, no locks,
+// producers and consumers only ever fight over their own index
+struct request_ring
+{
+	_Alignas(64) atomic_size_t tail;
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) size_t capacity;
+	struct ring_slot *slots;
+};
+
+// Futex based event used to park threads only when every queue is
+// really empty (workers) or the server is really full (server_request)
+struct ring_event
+{
+	_Alignas(64) atomic_uint seq;
+	atomic_int waiters;
+};
 
-	//Actual file data
+// A NUMA node and the cpus on it we're allowed to run on
+struct numa_node
+{
+	int id;
+	int nr_cpus;
+	cpu_set_t cpus;
+};
+
+// Every worker owns a queue that server_request deals requests into,
+// idle workers steal from their peers' queues
+struct worker
+{
+	pthread_t thread;
+	int id;
+	int node;
+	bool started;
+	struct server *sv;
+	struct request_ring queue;
+} __attribute__((aligned(64)));
+
+void ring_init(struct request_ring *ring, size_t capacity);
+void ring_destroy(struct request_ring *ring);
+bool ring_push(struct request_ring *ring, const struct work_item *item);
+bool ring_pop(struct request_ring *ring, struct work_item *item);
+int ring_pop_batch(struct request_ring *ring, struct work_item *items, int max);
+unsigned int ring_event_prepare(struct ring_event *event);
+void ring_event_wait(struct ring_event *event, unsigned int seen);
+bool ring_event_timedwait(struct ring_event *event, unsigned int seen, long timeout_ns);
+void ring_event_cancel(struct ring_event *event);
+void ring_event_signal(struct ring_event *event, int nr_wake);
+int worker_next_batch(struct worker *self, struct work_item *items);
+int worker_give_back(struct worker *self, struct work_item *items, int nr_items);
+long scheduler_estimate(struct server *sv, char *file_name);
+void scheduler_push(struct server *sv, const struct work_item *item);
+bool scheduler_pop(struct server *sv, struct work_item *item);
+void pool_maybe_grow(struct server *sv);
+void worker_start(struct server *sv, int id);
+void numa_discover(struct server *sv);
+void thread_place(struct server *sv, pthread_attr_t *attr, int node, int slot);
+bool worker_retire(struct worker *self);
+
+// Latency histograms have 16 linear buckets per power of two of
+// nanoseconds, so every value is within about 6% of its bucket
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram
+{
+	unsigned long counts[HISTOGRAM_BUCKETS];
+	unsigned long total;
+	unsigned long sum;
+	unsigned long max;
+};
+
+// Counters kept by one thread, only that thread writes them so no atomic
+// read-modify-writes are needed, except for the set threads without their own
+// share. They get added up when someone reads them
+struct server_stats
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long insert_failures;
+	unsigned long coalesced;
+	unsigned long streamed;
+	unsigned long async_reads;
+	unsigned long revalidations;
+	unsigned long negative_hits;
+	unsigned long negative_inserts;
+	unsigned long sjf_known;
+	unsigned long sjf_guessed;
+	unsigned long enqueued;
+	unsigned long rejected;
+	unsigned long expired;
+	unsigned long keepalive_reuses;
+	unsigned long pipelined;
+	unsigned long idle_closed;
+	unsigned long bytes_served;
+	unsigned long cache_lock_waits;
+	unsigned long cache_lock_wait_ns;
+	unsigned long admission_waits;
+	unsigned long admission_wait_ns;
+	unsigned long batches;
+	unsigned long batched_requests;
+
+	struct histogram queue_wait;
+	struct histogram read_time;
+	struct histogram send_time;
+} __attribute__((aligned(64)));
+
+void histogram_record(struct histogram *histogram, long value);
+
+struct cache_arena;
+struct cache_tier;
+
+struct wc_item
+{
+	//Actual file data, points at file once the file is loaded
 	struct file_data *data;
+	struct file_data file;
+
+	// Where the item and its file buffer came from, and how many bytes
+	// of its tier's budget they take up including slab rounding
+	struct cache_arena *arena;
+	struct cache_tier *tier;
+	long charge;
+
+	// The file is stored right after the key. A placeholder for a small
+	// file points at the entry that replaced it, and holds a reference to it
+	bool inlined;
+	struct wc_item *moved;
+
+	// The response header up to its blank line, put together when the file
+	// is cached so hits don't have to. A small file's is between the key and
+	// the file, a big file's is allocated on its own. Placeholders share theirs
+	char *header;
+	int header_len;
+
+	// References to the item, one for being in the cache and one for every
+	// thread using it. Whoever drops the last one frees it so eviction never
+	// has to wait for a slow client to finish
+	atomic_int refcount;
+
+	// Someone is reading the file in and data isn't there yet, or
+	// they gave up and the item is no longer in the cache
+	bool loading;
+	bool failed;
+
+	// Full hash of the key, and which file it was and when it was last
+	// changed as of reading it so changes on disk can be noticed
+	unsigned long hash;
+	struct timespec mtime;
+	dev_t dev;
+	ino_t ino;
 
-	// Reference bit
-	int ref_bit;
+	// When it was last compared with the file on disk, and if the
+	// watcher saw the file change while it was being read in
+	long checked;
+	bool changed;
 
-	// Pointer to next collision item because we're using
-	// chaining
-	struct wc_item *next;
+	// Replacement policy bookkeeping: clock's referenced bit,
+	// gdsf's access count, priority and place in the heap
+	bool referenced;
+	long frequency;
+	double priority;
+	long heap_index;
+
+	// Neighbours in the lru, prev is towards the head (most recently used)
+	struct wc_item *lru_prev;
 	struct wc_item *lru_next;
 
-	pthread_cond_t *done_sending;
+	// Signalled when the item is done loading, event loop connections
+	// waiting for it are parked here instead (linked through next)
+	pthread_cond_t loaded;
+	struct connection *parked;
+
+	// Hash key, allocated along with the item
+	char key[];
 };
 struct head_of_lru
 {
 	struct wc_item *head;
+	struct wc_item *tail;
 };
-struct wc
+
+// One bucket of a shard's index, the full hash is kept next to the
+// item so most mismatches never need a strcmp
+struct index_slot
+{
+	unsigned long hash;
+	struct wc_item *item;
+};
+
+// Open addressing (robin hood) hash table of the cached files, sized by
+// how many files there are, not how many bytes they take
+struct cache_index
+{
+	struct index_slot *slots;
+	unsigned long mask;
+	long count;
+};
+
+// Header at the start of every slab. Slabs are SLAB_SIZE aligned so
+// the slab an object lives in is found by masking its address
+struct slab
+{
+	struct slab *prev;
+	struct slab *next;
+	void *free_list;
+	char *unused;
+	int in_use;
+	int nr_objects;
+	int size_class;
+};
+
+// Slabs of one size class that still have room
+struct slab_class
+{
+	size_t object_size;
+	struct slab *partial;
+};
+
+// Where a shard gets memory for its entries and file buffers. It has its
+// own lock since buffers are allocated before the shard lock is taken and
+// freed by whoever drops the last reference
+struct cache_arena
+{
+	pthread_mutex_t lock;
+	struct slab_class classes[SLAB_CLASSES];
+
+	// Freed mappings waiting to be used again, the first word of
+	// each one points at the next
+	void *extents[EXTENT_CLASSES];
+
+	// Bytes mapped for slabs and for large objects, pooled_bytes
+	// of the large ones are sitting in extents
+	long slab_bytes;
+	long large_bytes;
+	long pooled_bytes;
+
+	// NUMA node everything is mapped on, -1 for wherever it's first touched
+	int node;
+};
+
+// The cache snapshot is this header followed by a record per file, least
+// recently used first. Every record is followed by the key (with its nul)
+// and the file, padded to 8 bytes
+#define SNAPSHOT_MAGIC "WCSNAP1"
+
+struct snapshot_header
+{
+	char magic[8];
+	uint64_t nr_records;
+};
+
+struct snapshot_record
+{
+	uint32_t key_len;
+	uint32_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+// A file that couldn't be opened and when to stop believing that
+struct negative_entry
+{
+	unsigned long hash;
+	long expires;
+	char *key;
+};
+
+// A directory can be named more than one way in keys ("a/" and "./a/"),
+// the watcher keeps every prefix it's seen for each watched directory
+struct watch_prefix
+{
+	struct watch_prefix *next;
+	char prefix[];
+};
+
+// inotify watcher thread, dirs is indexed by watch descriptor. known holds
+// the hashes of directories already watched so a miss there can skip both
+// the lock and the syscall, it's wiped whenever a watch goes away
+struct cache_watch
+{
+	int fd;
+	int wakefd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct watch_prefix **dirs;
+	int nr_dirs;
+	_Atomic unsigned long known[CACHE_WATCH_KNOWN];
+	atomic_long generation;
+};
+
+// Count-min sketch of how often keys were asked for, used by tinylfu
+// to decide if a new file is worth more than the one it would evict
+struct frequency_sketch
+{
+	unsigned char *counters;
+	unsigned long width_mask;
+	long samples;
+	long sample_limit;
+};
+
+struct wc;
+
+// Files in a shard are split by size into tiers, each with its own share of
+// the budget and its own replacement policy state
+struct cache_tier
 {
-	struct wc_item **files;
 	long count;
 	long size;
+
+	// Files thrown out of this tier, kept here since it's under the lock anyway
+	unsigned long evictions;
+
+	// Every cached file in the tier is on this list, newest at the head. lru
+	// keeps it in recency order, clock sweeps it with clock_hand
 	struct head_of_lru *lru_queue;
+	struct wc_item *clock_hand;
+
+	// gdsf min heap on priority and its inflation value
+	struct wc_item **heap;
+	long heap_count;
+	long heap_capacity;
+	double inflation;
+};
+
+// A cache replacement policy, every shard runs its own copy of the state
+// Hooks that a policy doesn't need are left NULL
+struct cache_policy
+{
+	const char *name;
+	void (*init)(struct wc *wc);
+	void (*destroy)(struct wc *wc);
+
+	// Every lookup, hit or miss. The others work on the item's tier
+	void (*access)(struct wc *wc, unsigned long hash);
+	void (*insert)(struct wc *wc, struct wc_item *item);
+	void (*hit)(struct wc *wc, struct wc_item *item);
+	void (*remove)(struct wc *wc, struct wc_item *item);
+
+	// Next file to throw out of a tier
+	struct wc_item *(*victim)(struct wc *wc, struct cache_tier *tier);
+
+	// Is new_file worth throwing out victim for
+	bool (*admit)(struct wc *wc, struct wc_item *new_file, struct wc_item *victim);
 };
 
-unsigned long hash_function(char *str, int max_table);
-int collision_handler(struct server *sv, struct wc *table, struct wc_item *collision_word, unsigned long index);
-void wc_item_destroy(struct server *sv, struct wc_item *item);
-struct wc_item *cache_lookup(struct server *sv, char *file_name);
-void cache_insert(struct server *sv, struct file_data *new_file);
-int cache_add(struct server *sv, struct file_data *data);
-int cache_evict(struct server *sv, struct wc_item *new_file, int index);
-void cache_delete(struct server *sv, struct wc_item *to_be_deleted, int index);
+// One shard of the cache, every shard has its own lock, hash table,
+// replacement policy state and byte budget so requests for files in
+// different shards never wait on each other
+struct wc
+{
+	pthread_mutex_t lock;
+	const struct cache_policy *policy;
+
+	// The small and large tiers, and the biggest file that goes in the small one
+	struct cache_tier tiers[CACHE_TIERS];
+	long small_max;
+
+	// Files dropped because they changed on disk, kept here since it's
+	// under the lock anyway
+	unsigned long invalidations;
+
+	// Memory for everything cached in this shard. The tiers' counts include
+	// the entries and slab rounding and the large tier's the index too, not
+	// just the files' bytes
+	struct cache_arena arena;
+
+	// The files in this shard. When the index grows the old one is kept
+	// around and moved over a few buckets per insert or delete instead
+	// of rehashing everything at once
+	struct cache_index index;
+	struct cache_index old_index;
+	unsigned long migrated;
+
+	// tinylfu frequency estimates
+	struct frequency_sketch *sketch;
+
+	// Files known not to be there, direct mapped on the hash so a new
+	// one just takes over its slot. Not charged to the byte budget
+	struct negative_entry *negative;
+	unsigned long negative_mask;
+	unsigned long negative_count;
+} __attribute__((aligned(64)));
+
+const struct cache_policy *cache_policy_find(const char *name);
+
+unsigned long hash_string(char *str);
+struct wc *cache_shard(struct server *sv, unsigned long hash);
+void index_init(struct cache_index *index, unsigned long nr_slots);
+struct index_slot *index_probe(struct cache_index *index, unsigned long hash, char *key, struct wc_item *item);
+void index_place(struct cache_index *index, unsigned long hash, struct wc_item *item);
+void index_erase(struct cache_index *index, struct index_slot *slot);
+void index_migrate(struct wc *wc, unsigned long steps);
+void arena_init(struct cache_arena *arena);
+void arena_destroy(struct cache_arena *arena);
+void *arena_alloc(struct cache_arena *arena, size_t size);
+void arena_free(struct cache_arena *arena, void *ptr, size_t size);
+long arena_charge(size_t size);
+void wc_item_destroy(struct wc_item *item);
+struct wc_item *cache_find(struct wc *wc, char *file_name, unsigned long hash);
+struct wc_item *cache_lookup(struct wc *wc, char *file_name, unsigned long hash);
+struct wc_item *cache_reserve(struct wc *wc, char *file_name, unsigned long hash);
+int cache_add(struct wc *wc, struct wc_item *new_file, struct file_data *data);
+void cache_abandon(struct wc *wc, struct wc_item *item);
+struct cache_tier *cache_tier_for(struct wc *wc, long file_size);
+void cache_release(struct wc_item *item);
+int cache_evict(struct wc *wc, struct cache_tier *tier, struct wc_item *new_file);
+void cache_unlink(struct wc *wc, struct wc_item *item);
+void cache_delete(struct wc *wc, struct wc_item *to_be_deleted);
+void cache_identify(struct wc_item *item, const struct stat *st);
+bool negative_find(struct wc *wc, char *file_name, unsigned long hash);
+void negative_add(struct wc *wc, char *file_name, unsigned long hash, long ttl_ns);
+void negative_forget(struct wc *wc, char *file_name, unsigned long hash);
+bool cache_check_due(struct server *sv, struct wc_item *item);
+bool cache_file_changed(struct wc_item *item);
+bool cache_invalidate(struct wc *wc, struct wc_item *item);
+struct cache_watch *cache_watch_start(struct server *sv);
+void cache_watch_stop(struct cache_watch *watch);
+void cache_watch_add(struct server *sv, const char *key);
+void cache_watch_function(struct server *sv);
 void maintain_lru(struct head_of_lru *lru_queue, struct wc_item *lru, bool new_file);
+void lru_remove(struct head_of_lru *lru_queue, struct wc_item *lru);
 struct wc_item *least_recently_used_file(struct head_of_lru *lru_queue);
+void cache_snapshot_save(struct server *sv, const char *path);
+void cache_snapshot_load(struct server *sv, const char *path);
 void print_cache(struct wc *wc);
 void print_lru(struct head_of_lru *lru_queue);
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -56,36 +840,93 @@ struct server
 	int nr_threads;
 	int max_requests;
 	int max_cache_size;
-	int exiting;
+	atomic_int exiting;
+
+	// Requests waiting for a worker across all the worker queues,
+	// server_request won't let this go past max_requests
+	_Alignas(64) atomic_int queued;
+	struct ring_event not_empty;
+	struct ring_event not_full;
 
-	// Fill this circular buffer in when processing a request
-	int *buffer;
+	// Turn requests away when full instead of waiting, and how long
+	// a request can wait for a worker before it's not worth serving
+	bool shed;
+	long deadline_ns;
 
-	// The cache for storing files
+	// Worker queue that gets the next request, round robin
+	_Alignas(64) atomic_uint next_worker;
+
+	// Scheduling shortest job first puts every request in one heap
+	// ordered by key instead of the workers' queues
+	bool sjf;
+	long sjf_max_wait_ns;
+	_Alignas(64) pthread_mutex_t sjf_lock;
+	struct work_item *sjf_heap;
+	int sjf_count;
+
+	// The cache for storing files, split into nr_shards shards
 	struct wc *cache;
+	int nr_shards;
+	const struct cache_policy *policy;
+
+	// Array of nr_threads worker slots, the first active of them are running.
+	// Only the last running worker can retire so that stays true
+	struct worker *workers;
+	_Alignas(64) atomic_int active;
+	int min_threads;
+	int batch_size;
+	long target_wait_ns;
+	long idle_ns;
+	pthread_mutex_t pool_lock;
+
+	// How threads are placed and the NUMA nodes there are to place them on,
+	// worker i, event loop i and shard i belong to nodes[i % nr_nodes]
+	int affinity;
+	struct numa_node *nodes;
+	int nr_nodes;
 
-	// Circular buffer tracker similar to procuder consumer question
-	// These need to be implemented using mutex and conditional variables
-	int in;
-	int out;
+	// Where the cache is saved on exit, and how many files were
+	// restored from it or dropped because they changed
+	char *snapshot_path;
+	unsigned long snapshot_restored;
+	unsigned long snapshot_stale;
 
-	// Array of worker threads
-	pthread_t **workers;
+	// Watcher dropping changed files, how long a cached file is trusted
+	// before it's compared with the disk again, and files last compared
+	// before revalidate_before get compared on their next hit
+	struct cache_watch *watch;
+	atomic_long revalidate_ns;
+	atomic_long revalidate_before;
 
-	// Conditional variables used to signal that the
-	// buffer is either full or empty
-	pthread_cond_t *full;
-	pthread_cond_t *empty;
+	// How long a file that couldn't be opened is taken to still be missing
+	long negative_ttl_ns;
 
-	// Conditional variable used to signal that
-	// a file is done being sent
-	pthread_cond_t *in_use;
+	// Moving average of how long a worker takes per request, and how
+	// many times the pool grew or shrank
+	_Alignas(64) atomic_long service_ns;
+	atomic_ulong threads_started;
+	atomic_ulong threads_retired;
 
-	// Mutex lock for critical sections
-	pthread_mutex_t *mutex_lock;
+	// Event loops owning connections when there are any, they're told
+	// to stop before the workers so every fetch they hand out is done
+	struct event_loop *loops;
+	int nr_loops;
+	atomic_int loops_exiting;
+	atomic_uint next_loop;
+	int keepalive_requests;
+	long conn_idle_ns;
 
-	// Mutex lock for checking the cache
-	pthread_mutex_t *mutex_cache_lock;
+	// One set of counters per worker and event loop plus one shared by everyone else
+	// (updated atomically since several threads can be in it at once),
+	// dumped by server_stats_dump or by sending the process SIGUSR1
+	struct server_stats *stats;
+	bool stats_signal;
+	pthread_t stats_thread;
+
+	// How a miss opens and reads the file, request_openfile and request_readfd.
+	// cache_sim swaps them for ones that make the file up from its trace
+	int (*open_file)(struct file_data *data, struct stat *st);
+	int (*read_file)(int fd, struct file_data *data);
 };
 
 /* static functions */
@@ -112,843 +953,5148 @@ file_data_free(struct file_data *data)
 	free(data);
 }
 
-static void
-do_server_request(struct server *sv, int connfd)
+/* monotonic clock in nanoseconds */
+static long
+now_ns(void)
 {
-	//printf("Do server request conffd: %d\n", connfd);
-	int ret;
-	int success = 0;
-	struct request *rq;
-	struct file_data *data;
+	struct timespec ts;
 
-	data = file_data_init();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000l + ts.tv_nsec;
+}
 
-	/* fill data->file_name with name of the file being requested */
-	rq = request_init(connfd, data);
-	if (!rq)
+/* the counters the calling thread should bump, workers and event loops have
+   their own and everyone else (acceptors, the watcher) shares the last set */
+static __thread struct server_stats *thread_stats;
+
+static struct server_stats *
+stats_self(struct server *sv)
+{
+	if (thread_stats != NULL)
 	{
-		file_data_free(data);
-		return;
+		return thread_stats;
 	}
+	return &sv->stats[sv->nr_threads + sv->nr_loops];
+}
 
-	if (sv->max_cache_size > 0)
-	{
-		pthread_mutex_lock(sv->mutex_cache_lock);
-		//printf("Cache look up for: %s\n", data->file_name);
-		struct wc_item *cached_file = cache_lookup(sv, data->file_name);
-		if (cached_file != NULL)
-		{
-			// Marked the cached file as in use...
-			cached_file->ref_bit++;
+/* add to a counter, without a locked instruction when this thread is the only
+   one writing it and with one when it's the shared set */
+#define STAT_ADD(counter, n) \
+	do \
+	{ \
+		if (thread_stats != NULL) \
+		{ \
+			atomic_store_explicit((_Atomic unsigned long *)&(counter), \
+								  atomic_load_explicit((_Atomic unsigned long *)&(counter), memory_order_relaxed) + (n), \
+								  memory_order_relaxed); \
+		} \
+		else \
+		{ \
+			atomic_fetch_add_explicit((_Atomic unsigned long *)&(counter), (n), memory_order_relaxed); \
+		} \
+	} while (0)
 
-			// If the file was found in cache then update data...
-			data->file_name = cached_file->data->file_name;
-			data->file_buf = cached_file->data->file_buf;
-			data->file_size = cached_file->data->file_size;
-			request_set_data(rq, data);
-		}
-		else
-		{
-			pthread_mutex_unlock(sv->mutex_cache_lock);
-			/* read file if you coulnd't find it in the cache, 
-			* fills data->file_buf with the file contents,
-			* data->file_size with file size. */
-			ret = request_readfile(rq);
-			if (ret == 0)
-			{ /* couldn't read file */
-				goto out;
-			}
-			pthread_mutex_lock(sv->mutex_cache_lock);
+/* read a counter someone else may be adding to */
+#define STAT_READ(counter) atomic_load_explicit((_Atomic unsigned long *)&(counter), memory_order_relaxed)
 
-			// Try adding the file to the cache
-			success = cache_add(sv, data);
-			if (success == 1)
-			{
-				int index = hash_function(data->file_name, sv->max_cache_size);
-				cached_file = sv->cache->files[index];
-				cached_file->ref_bit++;
-			}
-			// The file was found while trying to add it to the cache
-			else if (success == 2)
-			{
-				int index = hash_function(data->file_name, sv->max_cache_size);
-				cached_file = sv->cache->files[index];
+/* block SIGUSR1 while starting threads so only the stats thread takes it,
+   the old mask goes back with pthread_sigmask(SIG_SETMASK, old_mask, NULL) */
+static void
+stats_signal_block(struct server *sv, sigset_t *old_mask)
+{
+	sigset_t stats_signal;
 
-				// Toi compensate for chaining
-				while (cached_file->next != NULL && strcmp(cached_file->key, data->file_name) != 0)
-				{
-					cached_file = cached_file->next;
-				}
-				cached_file->ref_bit++;
-			}
-		}
+	sigemptyset(&stats_signal);
+	if (sv->stats_signal)
+	{
+		sigaddset(&stats_signal, SIGUSR1);
+	}
+	pthread_sigmask(SIG_BLOCK, &stats_signal, old_mask);
+}
 
-		// print_cache(sv->cache);
-		// print_lru(sv->cache->lru_queue);
-		pthread_mutex_unlock(sv->mutex_cache_lock);
+/* lock a shard, only timing it when someone else has it */
+static void
+shard_lock(struct server *sv, struct wc *shard)
+{
+	if (pthread_mutex_trylock(&shard->lock) == 0)
+	{
+		return;
+	}
 
-		/* send file to client */
-		request_sendfile(rq);
+	struct server_stats *stats = stats_self(sv);
+	long start = now_ns();
+	pthread_mutex_lock(&shard->lock);
+	STAT_ADD(stats->cache_lock_waits, 1);
+	STAT_ADD(stats->cache_lock_wait_ns, now_ns() - start);
+}
 
-		// Tell everyone that you're done sending the file...
-		if (cached_file != NULL)
-		{
-			pthread_mutex_lock(sv->mutex_cache_lock);
-			cached_file->ref_bit--;
+/* read an integer tunable from the environment, or use the default */
+static int
+server_config(const char *name, int def)
+{
+	char *value = getenv(name);
+
+	if (value == NULL || *value == '\0')
+	{
+		return def;
+	}
+	return atoi(value);
+}
 
-			// Only tell one thread to continue with eviction..
-			if (cached_file->ref_bit == 0)
+/* write all of buf to the client, returns 0 if the client went away */
+static int
+write_fully(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
 			{
-				//printf("Done sending %s\n", cached_file->key);
-				pthread_cond_broadcast(cached_file->done_sending);
+				continue;
 			}
-			pthread_mutex_unlock(sv->mutex_cache_lock);
-		}
-		else if (success == -1)
-		{
-			file_data_free(data);
+			return 0;
 		}
+		buf += ret;
+		len -= ret;
 	}
-	else
-	{
-		/* read file if you coulnd't find it in the cache, 
-			* fills data->file_buf with the file contents,
-			* data->file_size with file size. */
-		ret = request_readfile(rq);
-		if (ret == 0)
-		{ /* couldn't read file */
-			goto out;
-		}
+	return 1;
+}
 
-		/* send file to client */
-		request_sendfile(rq);
+/* the header request_sendfile puts in front of a file up to the blank line
+ * ending it, cached files keep theirs so it's only put together once */
+static int
+response_header_start(char *buf, size_t len, const char *file_name, int file_size)
+{
+	const char *file_type = "text/plain";
+
+	if (strstr(file_name, ".html"))
+	{
+		file_type = "text/html";
 	}
-out:
-	request_destroy(rq);
-	if (sv->max_cache_size == 0)
+	else if (strstr(file_name, ".gif"))
 	{
-		file_data_free(data);
+		file_type = "image/gif";
+	}
+	else if (strstr(file_name, ".jpg"))
+	{
+		file_type = "image/jpeg";
 	}
+
+	return snprintf(buf, len,
+					"HTTP/1.0 200 OK\r\n"
+					"Server: Tiny Web Server\r\n"
+					"Content-length: %d\r\n"
+					"Content-type: %s\r\n",
+					file_size, file_type);
 }
 
-/* entry point functions */
+/* the rest of the header, telling the client the connection stays open if keep_alive */
+static const char *
+response_header_end(bool keep_alive)
+{
+	return keep_alive ? "Connection: keep-alive\r\n\r\n" : "\r\n";
+}
 
-struct server *server_init(int nr_threads, int max_requests, int max_cache_size)
+/* the same response header request_sendfile puts in front of a file */
+static int
+response_header(char *buf, size_t len, struct file_data *data, bool keep_alive)
 {
-	struct server *sv;
+	int start = response_header_start(buf, len, data->file_name, data->file_size);
 
-	sv = Malloc(sizeof(struct server));
-	sv->nr_threads = nr_threads;
-	sv->max_requests = max_requests + 1;
-	sv->max_cache_size = max_cache_size;
-	sv->exiting = 0;
-
-	// Init the mutex locks and signals
-	// Use NULL to init because IDK what attributes to actually use
-	sv->mutex_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-	sv->mutex_cache_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-	sv->full = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
-	sv->empty = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
-	sv->in_use = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
-	pthread_cond_init(sv->in_use, NULL);
-	pthread_mutex_init(sv->mutex_lock, NULL);
-	pthread_mutex_init(sv->mutex_cache_lock, NULL);
-	pthread_cond_init(sv->full, NULL);
-	pthread_cond_init(sv->empty, NULL);
-	sv->in = 0;
-	sv->out = 0;
+	return start + snprintf(buf + start, len - start, "%s", response_header_end(keep_alive));
+}
 
-	if (nr_threads > 0 || max_requests > 0 || max_cache_size > 0)
+/* a whole Tiny style error page, header and all, it has a length so the
+ * connection can stay open after it like after a file */
+static int
+error_response(char *buf, size_t len, const char *cause,
+			   const char *errnum, const char *shortmsg, const char *longmsg, bool keep_alive)
+{
+	char body[MAXLINE];
+	int body_len = snprintf(body, sizeof(body),
+							"<html><title>Tiny Error</title>"
+							"<body bgcolor=\"ffffff\">\r\n"
+							"%s: %s\r\n"
+							"<p>%s: %.1024s\r\n"
+							"<hr><em>The Tiny Web server</em>\r\n",
+							errnum, shortmsg, longmsg, cause);
+
+	return snprintf(buf, len,
+					"HTTP/1.0 %s %s\r\n"
+					"Content-type: text/html\r\n"
+					"Content-length: %d\r\n%s%s",
+					errnum, shortmsg, body_len, response_header_end(keep_alive), body);
+}
+
+/* the error page for a file that wasn't sent, the same from a worker or an event loop.
+ * A 503 always closes, whoever is that busy doesn't want the next request either */
+static int
+fetch_error_response(char *buf, size_t len, enum fetch_result result, const char *file_name, bool keep_alive)
+{
+	switch (result)
 	{
-		// Buffer used to store requests
-		if (max_requests > 0)
-		{
-			sv->buffer = (int *)malloc((max_requests + 1) * (sizeof(int)));
-		}
+	case FETCH_FORBIDDEN:
+		return error_response(buf, len, file_name, "403", "Forbidden", "Tiny couldn't read the file", keep_alive);
+	case FETCH_FAILED:
+		return error_response(buf, len, file_name, "500", "Internal Server Error", "Tiny couldn't read the file", keep_alive);
+	case FETCH_OVERLOADED:
+		return error_response(buf, len, "try again later", "503", "Service Unavailable", "Tiny is too busy", false);
+	default:
+		return error_response(buf, len, file_name, "404", "Not found", "Tiny couldn't find this file", keep_alive);
+	}
+}
 
-		// Buffer is filled for worker threads to read...
+/* turn a connection away with a 503 without ever blocking. What's come in
+ * of the request is read first so closing doesn't reset the connection
+ * before the client sees the answer */
+static void
+server_reject(int connfd)
+{
+	char page[MAXLINE];
+	int len = fetch_error_response(page, sizeof(page), FETCH_OVERLOADED, NULL, false);
 
-		// Create nr_threads
-		// Allocate space for the array of threads
-		if (nr_threads > 0)
+	send(connfd, page, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(connfd, SHUT_WR);
+	for (int i = 0; i < 4 && recv(connfd, page, sizeof(page), MSG_DONTWAIT) > 0; i++)
+	{
+	}
+	close(connfd);
+}
+
+/* send a cached file and the header it was cached with in one writev,
+ * more only if the socket takes less than all of it */
+static void
+request_sendcached(int connfd, struct wc_item *cached)
+{
+	const char *end = response_header_end(false);
+	struct iovec iov[3] = {
+		{cached->header, cached->header_len},
+		{(char *)end, strlen(end)},
+		{cached->data->file_buf, cached->data->file_size},
+	};
+	struct iovec *next = iov;
+	int nr_iov = 3;
+
+	while (nr_iov > 0)
+	{
+		ssize_t ret = writev(connfd, next, nr_iov);
+		if (ret < 0)
 		{
-			sv->workers = (pthread_t **)malloc(sizeof(pthread_t *) * nr_threads);
-			for (int i = 0; i < nr_threads; i++)
+			if (errno == EINTR)
 			{
-				//printf("Creating thread %d\n", i);
+				continue;
+			}
+			return;
+		}
+
+		// Skip what went out
+		while (nr_iov > 0 && (size_t)ret >= next->iov_len)
+		{
+			ret -= next->iov_len;
+			next++;
+			nr_iov--;
+		}
+		if (nr_iov > 0)
+		{
+			next->iov_base = (char *)next->iov_base + ret;
+			next->iov_len -= ret;
+		}
+	}
+}
+
+/* send an open file straight from the page cache to the client with sendfile,
+ * the file is never read into our memory */
+static void
+request_streamfile(int connfd, int fd, struct file_data *data)
+{
+	char header[256];
+	off_t offset = 0;
 
-				// Allocate space for each individual thread
-				sv->workers[i] = (pthread_t *)malloc(sizeof(pthread_t));
+	if (!write_fully(connfd, header, response_header(header, sizeof(header), data, false)))
+	{
+		return;
+	}
 
-				// Init each thread by having them go to the stub function until a request
-				// has been parsed where they can then send all the info...
-				pthread_create(sv->workers[i], NULL, (void *)&stub_function, sv);
+	while (offset < data->file_size)
+	{
+		ssize_t ret = sendfile(connfd, fd, &offset, data->file_size - offset);
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		// Some sockets/files can't do sendfile, copy through a small buffer instead
+		if (ret < 0 && (errno == EINVAL || errno == ENOSYS))
+		{
+			char chunk[65536];
+			while (offset < data->file_size)
+			{
+				ret = pread(fd, chunk, sizeof(chunk), offset);
+				if (ret <= 0 || !write_fully(connfd, chunk, ret))
+				{
+					return;
+				}
+				offset += ret;
 			}
 		}
+		if (ret <= 0)
+		{
+			return;
+		}
+	}
+}
 
-		// Create the cache
-		// Allocate max_cache_size worth of space
-		if (max_cache_size > 0)
+/* find the file name request_init will come up with without taking the request
+ * off the socket. name is left empty if the request line isn't all there yet */
+static void
+request_peek_name(int connfd, char *name, size_t size)
+{
+	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+	ssize_t len = recv(connfd, buf, sizeof(buf) - 1, MSG_PEEK | MSG_DONTWAIT);
+
+	*name = '\0';
+	if (len <= 0)
+	{
+		return;
+	}
+	buf[len] = '\0';
+	if (strchr(buf, '\n') != NULL && sscanf(buf, "%s %s", method, uri) == 2 && !strcasecmp(method, "GET") &&
+		snprintf(name, size, ".%s", uri) >= (int)size)
+	{
+		*name = '\0';
+	}
+}
+
+/* where a request goes in shortest job first order, by how much it has to send */
+static long
+scheduler_key(struct server *sv, char *file_name, long queued_at)
+{
+	struct server_stats *stats = stats_self(sv);
+	long size = scheduler_estimate(sv, file_name);
+	long delay;
+
+	if (size < 0)
+	{
+		STAT_ADD(stats->sjf_guessed, 1);
+		size = SCHEDULER_MISS_SIZE;
+	}
+	else
+	{
+		STAT_ADD(stats->sjf_known, 1);
+	}
+
+	delay = size * SCHEDULER_NS_PER_BYTE;
+	return queued_at + (delay < sv->sjf_max_wait_ns ? delay : sv->sjf_max_wait_ns);
+}
+
+/* the worker whose queue gets the next request. With threads on NUMA nodes a
+ * request for a known file goes to a worker on the same node as its shard */
+static struct worker *
+worker_for(struct server *sv, char *file_name, unsigned int next)
+{
+	int active = atomic_load(&sv->active);
+
+	if (sv->nr_nodes > 1 && sv->cache != NULL && file_name != NULL && *file_name != '\0')
+	{
+		int node = (cache_shard(sv, hash_string(file_name)) - sv->cache) % sv->nr_nodes;
+		int on_node = (active - node + sv->nr_nodes - 1) / sv->nr_nodes;
+
+		if (on_node > 0)
+		{
+			return &sv->workers[node + sv->nr_nodes * (next % on_node)];
+		}
+	}
+	return &sv->workers[next % active];
+}
+
+/* open the requested file and get its size, and its stat if st isn't NULL. Returns -1 with
+ * errno set if it can't be opened, anything but a regular file is EACCES like Tiny's 403 */
+static int
+request_openfile(struct file_data *data, struct stat *st)
+{
+	struct stat file_st;
+	int fd = open(data->file_name, O_RDONLY);
+
+	if (st == NULL)
+	{
+		st = &file_st;
+	}
+	if (fd < 0)
+	{
+		return -1;
+	}
+	int err = fstat(fd, st) < 0 ? errno : !S_ISREG(st->st_mode) ? EACCES : 0;
+	if (err != 0)
+	{
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	data->file_size = st->st_size;
+	return fd;
+}
+
+/* what a request_openfile failure means for the client. Only a file that isn't
+ * there goes in the negative cache, running out of fds or a permission problem
+ * shouldn't turn into 404s for a file that's fine */
+static enum fetch_result
+request_openfailed(int err)
+{
+	if (err == ENOENT || err == ENOTDIR)
+	{
+		return FETCH_MISSING;
+	}
+	if (err == EACCES || err == EPERM)
+	{
+		return FETCH_FORBIDDEN;
+	}
+	return FETCH_FAILED;
+}
+
+/* read the whole open file into data->file_buf, which the caller allocated */
+static int
+request_readfd(int fd, struct file_data *data)
+{
+	int done = 0;
+
+	while (done < data->file_size)
+	{
+		ssize_t ret = read(fd, data->file_buf + done, data->file_size - done);
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret <= 0)
+		{
+			return 0;
+		}
+		done += ret;
+	}
+	return 1;
+}
+
+/* give up on loading a file into the cache, if we were loading one */
+static void
+cache_abandon_locked(struct server *sv, struct wc *shard, struct wc_item *loading)
+{
+	if (loading != NULL)
+	{
+		shard_lock(sv, shard);
+		cache_abandon(shard, loading);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/* give up on loading a file that couldn't be opened, and if it's because
+ * it isn't there (result is FETCH_MISSING) remember that it isn't */
+static void
+cache_missing_locked(struct server *sv, struct wc *shard, struct wc_item *loading, char *file_name,
+					 enum fetch_result result)
+{
+	struct server_stats *stats = stats_self(sv);
+
+	if (loading == NULL && (shard->negative == NULL || result != FETCH_MISSING))
+	{
+		return;
+	}
+	shard_lock(sv, shard);
+	if (loading != NULL)
+	{
+		cache_abandon(shard, loading);
+	}
+	if (shard->negative != NULL && result == FETCH_MISSING)
+	{
+		negative_add(shard, file_name, hash_string(file_name), sv->negative_ttl_ns);
+		STAT_ADD(stats->negative_inserts, 1);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* drop a cached file that turned out to have changed on disk */
+static void
+cache_invalidate_locked(struct server *sv, struct wc *shard, struct wc_item *item)
+{
+	shard_lock(sv, shard);
+	cache_invalidate(shard, item);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* find the requested file for sending: a cached copy, a private copy or an open
+ * file to stream. Records hits, misses and read time but not the send */
+static enum fetch_result
+server_fetch(struct server *sv, struct file_data *data, struct wc_item **cached, int *fd)
+{
+	int ret;
+	long start;
+	struct server_stats *stats = stats_self(sv);
+
+	*cached = NULL;
+	*fd = -1;
+
+	if (sv->max_cache_size > 0)
+	{
+		// Only the shard that owns this file needs to be locked
+		unsigned long hash = hash_string(data->file_name);
+		struct wc *shard = cache_shard(sv, hash);
+
+		shard_lock(sv, shard);
+		//printf("Cache look up for: %s\n", data->file_name);
+		struct wc_item *loading = NULL;
+		struct wc_item *cached_file = cache_lookup(shard, data->file_name, hash);
+		if (cached_file != NULL)
+		{
+			// Marked the cached file as in use, the shard's reference keeps
+			// it alive until we have our own...
+			atomic_fetch_add_explicit(&cached_file->refcount, 1, memory_order_relaxed);
+
+			// Someone else is already reading this file in, wait for
+			// them and share their copy instead of reading it again
+			if (cached_file->loading)
+			{
+				STAT_ADD(stats->coalesced, 1);
+				while (cached_file->loading)
+				{
+					pthread_cond_wait(&cached_file->loaded, &shard->lock);
+				}
+
+				// They couldn't cache it, so we're on our own
+				if (cached_file->failed)
+				{
+					cache_release(cached_file);
+					cached_file = NULL;
+				}
+				// It went into the small tier as a new item, use that one
+				else if (cached_file->moved != NULL)
+				{
+					struct wc_item *moved = cached_file->moved;
+					atomic_fetch_add_explicit(&moved->refcount, 1, memory_order_relaxed);
+					cache_release(cached_file);
+					cached_file = moved;
+				}
+			}
+		}
+		// Asked for before and it wasn't there
+		else if (negative_find(shard, data->file_name, hash))
+		{
+			STAT_ADD(stats->negative_hits, 1);
+			pthread_mutex_unlock(&shard->lock);
+			return FETCH_NEGATIVE;
+		}
+		else
 		{
-			sv->cache = (struct wc *)malloc(sizeof(struct wc));
+			// We're the first to miss, everyone else asking for
+			// this file waits for us to read it in
+			loading = cache_reserve(shard, data->file_name, hash);
+		}
 
-			// Array for storing all the files
-			sv->cache->files = (struct wc_item **)malloc(sizeof(struct wc_item *) * max_cache_size);
-			for (int i = 0; i < max_cache_size; i++)
+		if (cached_file != NULL)
+		{
+			// Every so often make sure it's still the file on disk,
+			// if it isn't it's dropped and we start over
+			bool check = cache_check_due(sv, cached_file);
+			pthread_mutex_unlock(&shard->lock);
+			if (check)
 			{
-				sv->cache->files[i] = NULL;
+				STAT_ADD(stats->revalidations, 1);
+				if (cache_file_changed(cached_file))
+				{
+					cache_invalidate_locked(sv, shard, cached_file);
+					cache_release(cached_file);
+					return server_fetch(sv, data, cached, fd);
+				}
 			}
 
-			sv->cache->count = 0;
-			sv->cache->size = max_cache_size;
-			sv->cache->lru_queue = (struct head_of_lru *)malloc(sizeof(struct head_of_lru));
-			sv->cache->lru_queue->head = NULL;
+			// If the file was found in cache then send the cached copy
+			STAT_ADD(stats->hits, 1);
+			*cached = cached_file;
+			return FETCH_CACHED;
+		}
+
+		STAT_ADD(stats->misses, 1);
+		pthread_mutex_unlock(&shard->lock);
+
+		// Watch for changes before opening so none can slip by unseen
+		if (loading != NULL)
+		{
+			cache_watch_add(sv, data->file_name);
+		}
+
+		// If we can't open it the caller sends the error
+		struct stat st;
+		*fd = sv->open_file(data, &st);
+		if (*fd < 0)
+		{
+			enum fetch_result result = request_openfailed(errno);
+			cache_missing_locked(sv, shard, loading, data->file_name, result);
+			return result;
+		}
+		if (loading != NULL)
+		{
+			cache_identify(loading, &st);
+		}
+
+		// Files that can never fit in their tier are streamed
+		// instead of being read in just to be thrown away, and so
+		// are ones there's no memory to read into right now.
+		// The buffer comes from the shard's arena so the cache
+		// can keep it as is
+		if (arena_charge(data->file_size) > cache_tier_for(shard, data->file_size)->size ||
+			(data->file_buf = arena_alloc(&shard->arena, data->file_size)) == NULL)
+		{
+			cache_abandon_locked(sv, shard, loading);
+			STAT_ADD(stats->streamed, 1);
+			return FETCH_STREAM;
+		}
+
+		/* read file if you coulnd't find it in the cache, 
+		* fills data->file_buf with the file contents,
+		* data->file_size with file size */
+		start = now_ns();
+		ret = sv->read_file(*fd, data);
+		histogram_record(&stats->read_time, now_ns() - start);
+		close(*fd);
+		*fd = -1;
+		if (ret == 0)
+		{ /* couldn't read file */
+			arena_free(&shard->arena, data->file_buf, data->file_size);
+			data->file_buf = NULL;
+			cache_abandon_locked(sv, shard, loading);
+			return FETCH_FAILED;
+		}
+
+		// Try adding the file to the cache, when it goes in the cache
+		// owns the buffer from now on and everyone waiting gets it too
+		if (loading != NULL)
+		{
+			shard_lock(sv, shard);
+			ret = cache_add(shard, loading, data);
+			// print_cache(shard);
+			// print_lru(shard->lru_queue);
+			pthread_mutex_unlock(&shard->lock);
+			if (ret == 1)
+			{
+				data->file_buf = NULL;
+				*cached = loading;
+				return FETCH_CACHED;
+			}
+			STAT_ADD(stats->insert_failures, 1);
 		}
+		return FETCH_COPY;
 	}
 
-	return sv;
+	// Nothing is cached so never bring the file into memory,
+	// stream it to the client
+	*fd = sv->open_file(data, NULL);
+	if (*fd < 0)
+	{
+		return request_openfailed(errno);
+	}
+	STAT_ADD(stats->streamed, 1);
+	return FETCH_STREAM;
 }
 
-void server_request(struct server *sv, int connfd)
+/* done sending what server_fetch found, if a cached file got evicted in the
+ * meantime this frees it, no lock needed. A private copy goes back to the arena */
+static void
+server_fetch_done(struct server *sv, struct file_data *data, struct wc_item *cached)
 {
-	// //printf("Server request connfd: %d\n", connfd);
+	if (cached != NULL)
+	{
+		cache_release(cached);
+	}
+	else if (data->file_buf != NULL)
+	{
+		arena_free(&cache_shard(sv, hash_string(data->file_name))->arena, data->file_buf, data->file_size);
+		data->file_buf = NULL;
+	}
+}
+
+static void
+do_server_request(struct server *sv, int connfd)
+{
+	//printf("Do server request conffd: %d\n", connfd);
+	int fd;
+	long start;
+	struct request *rq;
+	struct file_data *data;
+	struct wc_item *cached_file;
+	struct server_stats *stats = stats_self(sv);
+
+	data = file_data_init();
+
+	/* fill data->file_name with name of the file being requested */
+	rq = request_init(connfd, data);
+	if (!rq)
+	{
+		file_data_free(data);
+		return;
+	}
+
+	enum fetch_result result = server_fetch(sv, data, &cached_file, &fd);
+	switch (result)
+	{
+	case FETCH_MISSING:
+	case FETCH_NEGATIVE:
+	case FETCH_FORBIDDEN:
+	case FETCH_FAILED:
+		// The same error page the event loops send, found in the cache or not
+		{
+			char page[MAXLINE];
+			write_fully(connfd, page, fetch_error_response(page, sizeof(page), result, data->file_name, false));
+		}
+		break;
+	case FETCH_STREAM:
+		start = now_ns();
+		request_streamfile(connfd, fd, data);
+		histogram_record(&stats->send_time, now_ns() - start);
+		STAT_ADD(stats->bytes_served, data->file_size);
+		close(fd);
+		break;
+	case FETCH_CACHED:
+		/* a hit is sent without formatting anything */
+		start = now_ns();
+		request_sendcached(connfd, cached_file);
+		histogram_record(&stats->send_time, now_ns() - start);
+		STAT_ADD(stats->bytes_served, cached_file->data->file_size);
+		server_fetch_done(sv, data, cached_file);
+		break;
+	case FETCH_COPY:
+		/* send file to client */
+		request_set_data(rq, cached_file != NULL ? cached_file->data : data);
+		start = now_ns();
+		request_sendfile(rq);
+		histogram_record(&stats->send_time, now_ns() - start);
+		STAT_ADD(stats->bytes_served, cached_file != NULL ? cached_file->data->file_size : data->file_size);
+		server_fetch_done(sv, data, cached_file);
+		break;
+	case FETCH_OVERLOADED:
+		break;
+	}
+
+	request_destroy(rq);
+	file_data_free(data);
+}
+
+/* entry point functions */
+
+struct server *server_init(int nr_threads, int max_requests, int max_cache_size)
+{
+	struct server *sv;
+
+	sv = Malloc(sizeof(struct server));
+	sv->nr_threads = nr_threads;
+	sv->max_requests = max_requests > 0 ? max_requests : 1;
+	sv->max_cache_size = max_cache_size;
+	atomic_init(&sv->exiting, 0);
+	sv->cache = NULL;
+	sv->nr_shards = 0;
+	sv->policy = NULL;
+
+	atomic_init(&sv->queued, 0);
+	char *admission = getenv("SERVER_ADMISSION");
+	sv->shed = !strcmp(admission != NULL ? admission : ADMISSION, "shed");
+	sv->deadline_ns = server_config("SERVER_QUEUE_DEADLINE_MS", QUEUE_DEADLINE_MS) * 1000000l;
+	atomic_init(&sv->next_worker, 0);
+	atomic_init(&sv->active, 0);
+	sv->min_threads = 0;
+	sv->batch_size = 0;
+	pthread_mutex_init(&sv->pool_lock, NULL);
+	sv->sjf = false;
+	sv->sjf_max_wait_ns = 0;
+	pthread_mutex_init(&sv->sjf_lock, NULL);
+	sv->sjf_heap = NULL;
+	sv->sjf_count = 0;
+	atomic_init(&sv->service_ns, 0);
+	atomic_init(&sv->threads_started, 0);
+	atomic_init(&sv->threads_retired, 0);
+	sv->open_file = request_openfile;
+	sv->read_file = request_readfd;
+	sv->snapshot_path = NULL;
+	sv->snapshot_restored = 0;
+	sv->snapshot_stale = 0;
+	sv->watch = NULL;
+	sv->negative_ttl_ns = 0;
+	atomic_init(&sv->revalidate_ns, 0);
+	atomic_init(&sv->revalidate_before, 0);
+	atomic_init(&sv->not_empty.seq, 0);
+	atomic_init(&sv->not_empty.waiters, 0);
+	atomic_init(&sv->not_full.seq, 0);
+	atomic_init(&sv->not_full.waiters, 0);
+
+	sv->loops = NULL;
+	sv->nr_loops = server_config("SERVER_EVENT_LOOPS", EVENT_LOOPS);
+	if (sv->nr_loops < 0)
+	{
+		sv->nr_loops = 0;
+	}
+	atomic_init(&sv->loops_exiting, 0);
+	atomic_init(&sv->next_loop, 0);
+	sv->keepalive_requests = server_config("SERVER_KEEPALIVE_REQUESTS", KEEPALIVE_REQUESTS);
+	sv->conn_idle_ns = server_config("SERVER_KEEPALIVE_IDLE_MS", KEEPALIVE_IDLE_MS) * 1000000l;
+
+	// Find the NUMA nodes before any thread or shard is put on one
+	char *affinity = getenv("SERVER_AFFINITY");
+	if (affinity == NULL)
+	{
+		affinity = AFFINITY;
+	}
+	sv->affinity = !strcmp(affinity, "core") ? AFFINITY_CORE : !strcmp(affinity, "node") ? AFFINITY_NODE : AFFINITY_NONE;
+	sv->nodes = NULL;
+	sv->nr_nodes = 1;
+	if (sv->affinity != AFFINITY_NONE)
+	{
+		numa_discover(sv);
+	}
+
+	// Zeroed counters for every worker and event loop and one for everybody else
+	sv->stats = (struct server_stats *)aligned_alloc(64, sizeof(struct server_stats) * (nr_threads + sv->nr_loops + 1));
+	memset(sv->stats, 0, sizeof(struct server_stats) * (nr_threads + sv->nr_loops + 1));
+
+	// SIGUSR1 is handled by a thread waiting for it so the dump can do
+	// normal io, every thread we start has it blocked but the caller's
+	// mask is put back before returning
+	sigset_t old_mask;
+	sv->stats_signal = server_config("SERVER_STATS_SIGNAL", STATS_SIGNAL) != 0;
+	stats_signal_block(sv, &old_mask);
+
+	if (nr_threads > 0 || max_requests > 0 || max_cache_size > 0)
+	{
+
+		// Create the cache before any worker can look at it
+		// The byte budget is split evenly between the shards
+		if (max_cache_size > 0)
+		{
+			sv->nr_shards = server_config("SERVER_CACHE_SHARDS", CACHE_SHARDS);
+			if (sv->nr_shards > max_cache_size / CACHE_SHARD_MIN_SIZE)
+			{
+				sv->nr_shards = max_cache_size / CACHE_SHARD_MIN_SIZE;
+			}
+			if (sv->nr_shards < 1)
+			{
+				sv->nr_shards = 1;
+			}
+
+			char *policy = getenv("SERVER_CACHE_POLICY");
+			sv->policy = cache_policy_find(policy != NULL ? policy : CACHE_POLICY);
+
+			// The negative cache gets a power of two of slots per shard
+			unsigned long negative_slots = 0;
+			int negative_entries = server_config("SERVER_NEGATIVE_ENTRIES", NEGATIVE_ENTRIES);
+			sv->negative_ttl_ns = server_config("SERVER_NEGATIVE_TTL_MS", NEGATIVE_TTL_MS) * 1000000l;
+			if (negative_entries > 0 && sv->negative_ttl_ns > 0)
+			{
+				negative_slots = 1;
+				while (negative_slots * 2 * sv->nr_shards <= (unsigned long)negative_entries)
+				{
+					negative_slots *= 2;
+				}
+			}
+
+			// Small files get their share of every shard
+			int small_percent = server_config("SERVER_CACHE_SMALL_PERCENT", CACHE_SMALL_PERCENT);
+			long small_max = server_config("SERVER_CACHE_SMALL_MAX", CACHE_SMALL_MAX);
+			if (small_percent <= 0 || small_percent >= 100 || small_max <= 0)
+			{
+				small_percent = 0;
+				small_max = -1;
+			}
+
+			sv->cache = (struct wc *)aligned_alloc(64, sizeof(struct wc) * sv->nr_shards);
+			for (int i = 0; i < sv->nr_shards; i++)
+			{
+				struct wc *shard = &sv->cache[i];
+				long size = max_cache_size / sv->nr_shards;
+
+				pthread_mutex_init(&shard->lock, NULL);
+				arena_init(&shard->arena);
+				if (sv->nr_nodes > 1)
+				{
+					shard->arena.node = sv->nodes[i % sv->nr_nodes].id;
+				}
+				if (i < max_cache_size % sv->nr_shards)
+				{
+					size++;
+				}
+
+				shard->small_max = small_max;
+				for (int j = 0; j < CACHE_TIERS; j++)
+				{
+					struct cache_tier *tier = &shard->tiers[j];
+
+					tier->count = 0;
+					tier->evictions = 0;
+					tier->lru_queue = (struct head_of_lru *)malloc(sizeof(struct head_of_lru));
+					tier->lru_queue->head = NULL;
+					tier->lru_queue->tail = NULL;
+					tier->clock_hand = NULL;
+					tier->heap = NULL;
+					tier->heap_count = 0;
+					tier->heap_capacity = 0;
+					tier->inflation = 0;
+				}
+				shard->tiers[TIER_SMALL].size = size * small_percent / 100;
+				shard->tiers[TIER_LARGE].size = size - shard->tiers[TIER_SMALL].size;
+
+				// Index for finding all the files, it's charged to the large tier
+				index_init(&shard->index, INDEX_MIN_SLOTS);
+				shard->tiers[TIER_LARGE].count = INDEX_MIN_SLOTS * sizeof(struct index_slot);
+				shard->old_index.slots = NULL;
+				shard->old_index.count = 0;
+				shard->migrated = 0;
+
+				shard->sketch = NULL;
+				shard->invalidations = 0;
+				shard->negative = negative_slots > 0 ? (struct negative_entry *)calloc(negative_slots, sizeof(struct negative_entry)) : NULL;
+				shard->negative_mask = negative_slots - 1;
+				shard->negative_count = 0;
+
+				shard->policy = sv->policy;
+				if (shard->policy->init != NULL)
+				{
+					shard->policy->init(shard);
+				}
+			}
+
+			// Changed files are dropped as the watcher sees them, or noticed
+			// on a hit once in a while when there's no watcher
+			if (server_config("SERVER_CACHE_WATCH", CACHE_WATCH) != 0)
+			{
+				// Sets sv->watch itself before the thread can look at it
+				cache_watch_start(sv);
+			}
+			atomic_store(&sv->revalidate_ns,
+						 server_config("SERVER_CACHE_REVALIDATE_MS", sv->watch != NULL ? 0 : CACHE_REVALIDATE_MS) * 1000000l);
+
+			// Warm the cache back up from the last run before anyone can use it
+			char *snapshot = getenv("SERVER_CACHE_SNAPSHOT");
+			if (snapshot == NULL)
+			{
+				snapshot = CACHE_SNAPSHOT;
+			}
+			if (*snapshot != '\0')
+			{
+				sv->snapshot_path = strdup(snapshot);
+				cache_snapshot_load(sv, sv->snapshot_path);
+			}
+		}
+
+		// Buffer is filled for worker threads to read...
+
+		// Create nr_threads
+		// Allocate space for the array of threads
+		if (nr_threads > 0)
+		{
+			sv->workers = (struct worker *)aligned_alloc(64, sizeof(struct worker) * nr_threads);
+
+			// Start with the minimum, any more are started when needed
+			sv->min_threads = server_config("SERVER_MIN_THREADS", nr_threads);
+			if (sv->min_threads < 1 || sv->min_threads > nr_threads)
+			{
+				sv->min_threads = nr_threads;
+			}
+			sv->batch_size = server_config("SERVER_WORKER_BATCH", WORKER_BATCH);
+			if (sv->batch_size < 1 || sv->batch_size > WORKER_BATCH_MAX)
+			{
+				sv->batch_size = sv->batch_size < 1 ? 1 : WORKER_BATCH_MAX;
+			}
+			sv->target_wait_ns = server_config("SERVER_POOL_TARGET_WAIT_US", POOL_TARGET_WAIT_US) * 1000l;
+			sv->idle_ns = server_config("SERVER_POOL_IDLE_MS", POOL_IDLE_MS) * 1000000l;
+
+			// Admission keeps the heap to max_requests just like the queues
+			char *scheduler = getenv("SERVER_SCHEDULER");
+			if (strcmp(scheduler != NULL ? scheduler : SCHEDULER, "sjf") == 0)
+			{
+				sv->sjf = true;
+				sv->sjf_max_wait_ns = server_config("SERVER_SCHEDULER_MAX_WAIT_US", SCHEDULER_MAX_WAIT_US) * 1000l;
+				sv->sjf_heap = (struct work_item *)Malloc(sizeof(struct work_item) * (max_requests > 0 ? max_requests : 1));
+			}
+
+			// Every queue is big enough to hold all max_requests requests, so
+			// pushing only ever fails when the whole server is full
+			for (int i = 0; i < nr_threads; i++)
+			{
+				sv->workers[i].id = i;
+				sv->workers[i].node = i % sv->nr_nodes;
+				sv->workers[i].started = false;
+				sv->workers[i].sv = sv;
+				ring_init(&sv->workers[i].queue, max_requests > 0 ? max_requests : 1);
+			}
+
+			for (int i = 0; i < sv->min_threads; i++)
+			{
+				//printf("Creating thread %d\n", i);
+				atomic_fetch_add(&sv->active, 1);
+				worker_start(sv, i);
+			}
+		}
+	}
+
+	// Event loops go last, they hand file reads to the workers
+	if (sv->nr_loops > 0)
+	{
+		sv->loops = (struct event_loop *)aligned_alloc(64, sizeof(struct event_loop) * sv->nr_loops);
+		for (int i = 0; i < sv->nr_loops; i++)
+		{
+			struct event_loop *loop = &sv->loops[i];
+			struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+
+			loop->id = i;
+			loop->sv = sv;
+			loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+			loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			assert(loop->epfd >= 0 && loop->wakefd >= 0);
+			epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &event);
+			atomic_init(&loop->incoming, NULL);
+			atomic_init(&loop->finished, NULL);
+			loop->backlog = NULL;
+			loop->backlog_tail = NULL;
+			loop->connections = NULL;
+			loop->nr_connections = 0;
+			loop->idle_head = NULL;
+			loop->idle_tail = NULL;
+			loop->pipelined = NULL;
+
+			// Completions poke wakefd just like the workers do
+			loop->ring.fd = -1;
+			if (max_cache_size > 0 && server_config("SERVER_IO_URING", IO_URING) &&
+				uring_init(&loop->ring, IO_URING_DEPTH) == 0 &&
+				syscall(__NR_io_uring_register, loop->ring.fd, IORING_REGISTER_EVENTFD, &loop->wakefd, 1) < 0)
+			{
+				uring_destroy(&loop->ring);
+			}
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			thread_place(sv, &attr, i % sv->nr_nodes, -1);
+			pthread_create(&loop->thread, &attr, (void *)&event_loop_function, loop);
+			pthread_attr_destroy(&attr);
+		}
+	}
+
+	// Last, so a dump never sees a half built server
+	if (sv->stats_signal)
+	{
+		pthread_create(&sv->stats_thread, NULL, (void *)&stats_function, sv);
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	return sv;
+}
+
+void server_request(struct server *sv, int connfd)
+{
+	// //printf("Server request connfd: %d\n", connfd);
+	server_request_batch(sv, &connfd, 1);
+}
+
+// Queue nr_requests connections at once, paying for admission, the queue
+// pushes and the wake up once per batch instead of once per connection
+void server_request_batch(struct server *sv, int *connfds, int nr_requests)
+{
+	if (sv->nr_loops > 0)
+	{ /* an event loop owns the connection from here on */
+		for (int i = 0; i < nr_requests; i++)
+		{
+			event_loop_add(sv, connfds[i]);
+		}
+	}
+	else if (sv->nr_threads == 0)
+	{ /* no worker threads */
+		for (int i = 0; i < nr_requests; i++)
+		{
+			do_server_request(sv, connfds[i]);
+		}
+	}
+	else
+	{
+		/*  Save the relevant info in the ring and have one of the
+		 *  worker threads do the work. */
+		struct server_stats *stats = stats_self(sv);
+		int done = 0;
+
+		while (done < nr_requests)
+		{
+			// Wait while max_requests requests are already queued, this is
+			// woken up by a worker in stub_function taking requests out.
+			// Then take as much of the room as the rest of the batch needs
+			long start = 0;
+			int admitted;
+			int queued = atomic_load(&sv->queued);
+			while (true)
+			{
+				admitted = sv->max_requests - queued;
+				if (admitted > nr_requests - done)
+				{
+					admitted = nr_requests - done;
+				}
+				if (admitted > 0)
+				{
+					if (atomic_compare_exchange_weak(&sv->queued, &queued, queued + admitted))
+					{
+						break;
+					}
+					continue;
+				}
+				if (sv->shed)
+				{
+					break;
+				}
+
+				// //printf("In server_request waiting for not_full\n");
+				if (start == 0)
+				{
+					start = now_ns();
+				}
+				unsigned int seen = ring_event_prepare(&sv->not_full);
+				if (atomic_load(&sv->queued) >= sv->max_requests)
+				{
+					ring_event_wait(&sv->not_full, seen);
+				}
+				else
+				{
+					ring_event_cancel(&sv->not_full);
+				}
+				queued = atomic_load(&sv->queued);
+			}
+
+			// Full and shedding, the rest of the batch is turned away
+			// right here so we can go back to accepting
+			if (admitted <= 0)
+			{
+				for (; done < nr_requests; done++)
+				{
+					server_reject(connfds[done]);
+					STAT_ADD(stats->rejected, 1);
+				}
+				break;
+			}
+
+			long now = now_ns();
+			if (start != 0)
+			{
+				STAT_ADD(stats->admission_waits, 1);
+				STAT_ADD(stats->admission_wait_ns, now - start);
+			}
+			STAT_ADD(stats->enqueued, admitted);
+
+			// Deal the requests round robin into the running workers' queues,
+			// or peek at what they want and put them in order or on their node
+			unsigned int next = atomic_fetch_add_explicit(&sv->next_worker, admitted, memory_order_relaxed);
+			for (int i = 0; i < admitted; i++, next++)
+			{
+				struct work_item item = {connfds[done + i], now, NULL, now};
+				char name[MAXLINE] = "";
+
+				if (sv->sjf || sv->nr_nodes > 1)
+				{
+					request_peek_name(item.connfd, name, sizeof(name));
+				}
+				if (sv->sjf)
+				{
+					item.key = scheduler_key(sv, name, now);
+					scheduler_push(sv, &item);
+					continue;
+				}
+				while (!ring_push(&worker_for(sv, name, next)->queue, &item))
+				{
+					next++;
+				}
+			}
+			done += admitted;
+
+			// Tell the threads waiting for work that there are requests availible,
+			// if an owner is busy whoever wakes up steals it
+			ring_event_signal(&sv->not_empty, admitted);
+			pool_maybe_grow(sv);
+		}
+	}
+}
+
+void server_exit(struct server *sv)
+{
+	/* when using one or more worker threads, use sv->exiting to indicate to
+	 * these threads that the server is exiting. make sure to call
+	 * pthread_join in this function so that the main server thread waits
+	 * for all the worker threads to exit before exiting. */
+
+	// Event loops finish what they've started first, the workers are
+	// still around to do any reads they hand out while doing that
+	if (sv->nr_loops > 0)
+	{
+		atomic_store(&sv->loops_exiting, 1);
+		for (int i = 0; i < sv->nr_loops; i++)
+		{
+			eventfd_write(sv->loops[i].wakefd, 1);
+		}
+		for (int i = 0; i < sv->nr_loops; i++)
+		{
+			pthread_join(sv->loops[i].thread, NULL);
+			if (sv->loops[i].ring.fd >= 0)
+			{
+				uring_destroy(&sv->loops[i].ring);
+			}
+			close(sv->loops[i].epfd);
+			close(sv->loops[i].wakefd);
+		}
+		free(sv->loops);
+	}
+
+	atomic_store(&sv->exiting, 1);
+	//printf("Sent exit command to threads!\n");
+
+	// Tell all threads to leave the worker loop
+	ring_event_signal(&sv->not_empty, INT_MAX);
+	if (sv->stats_signal)
+	{
+		pthread_kill(sv->stats_thread, SIGUSR1);
+		pthread_join(sv->stats_thread, NULL);
+	}
+
+	// Join all threads
+	if (sv->nr_threads > 0)
+	{
+
+		// Retired workers are joined too, nothing can start one now
+		for (int i = 0; i < sv->nr_threads; i++)
+		{
+			if (sv->workers[i].started)
+			{
+				pthread_join(sv->workers[i].thread, NULL);
+			}
+		}
+	}
+
+	/* make sure to free any allocated resources */
+	// Free all the thread workers and their queues
+	if (sv->nr_threads > 0)
+	{
+		for (int i = 0; i < sv->nr_threads; i++)
+		{
+			ring_destroy(&sv->workers[i].queue);
+		}
+		free(sv->workers);
+	}
+	free(sv->sjf_heap);
+	pthread_mutex_destroy(&sv->sjf_lock);
+	free(sv->nodes);
+
+	// Free the cache, saving it first if there's somewhere to save it...
+	if (sv->max_cache_size > 0)
+	{
+		if (sv->watch != NULL)
+		{
+			cache_watch_stop(sv->watch);
+		}
+		if (sv->snapshot_path != NULL)
+		{
+			cache_snapshot_save(sv, sv->snapshot_path);
+			free(sv->snapshot_path);
+		}
+
+		for (int i = 0; i < sv->nr_shards; i++)
+		{
+			struct wc *shard = &sv->cache[i];
+
+			// Finish moving things out of an old index so there's only one left
+			index_migrate(shard, ULONG_MAX);
+			for (unsigned long j = 0; j <= shard->index.mask; j++)
+			{
+				if (shard->index.slots[j].item != NULL)
+				{
+					wc_item_destroy(shard->index.slots[j].item);
+				}
+			}
+			if (shard->policy->destroy != NULL)
+			{
+				shard->policy->destroy(shard);
+			}
+			if (shard->negative != NULL)
+			{
+				for (unsigned long j = 0; j <= shard->negative_mask; j++)
+				{
+					free(shard->negative[j].key);
+				}
+				free(shard->negative);
+			}
+			free(shard->index.slots);
+			for (int j = 0; j < CACHE_TIERS; j++)
+			{
+				free(shard->tiers[j].lru_queue);
+			}
+			arena_destroy(&shard->arena);
+			pthread_mutex_destroy(&shard->lock);
+		}
+		free(sv->cache);
+	}
+
+	free(sv->stats);
+
+	pthread_mutex_destroy(&sv->pool_lock);
+	free(sv);
+}
+
+//~~~~~ Implemented added functions ~~~~~
+
+// Have worker threads chill out here (blocked) until
+// the master thread hands one of them a request
+void stub_function(struct worker *self)
+{
+	struct server *sv = self->sv;
+
+	thread_stats = &sv->stats[self->id];
+
+	// //printf("Thread arrived at stub!\n");
+	// Similar to the producer consumer problem, have threads wait until
+	// there is a request before serving it
+	while (true)
+	{
+		struct work_item batch[WORKER_BATCH_MAX];
+		int nr_requests;
+
+		// Wait while every queue is empty, meaning that there are no more
+		// requests to be filled. server_request wakes one waiting thread
+		// per new request so idle workers don't stampede
+		while ((nr_requests = worker_next_batch(self, batch)) == 0)
+		{
+			unsigned int seen = ring_event_prepare(&sv->not_empty);
+
+			// Check again now that we're registered so a request
+			// can't slip in before we park
+			if ((nr_requests = worker_next_batch(self, batch)) > 0)
+			{
+				ring_event_cancel(&sv->not_empty);
+				break;
+			}
+
+			// When the server calls sv->exiting and everything queued
+			// has been handled then exit the thread
+			if (atomic_load(&sv->exiting) == 1)
+			{
+				// //printf("Exiting thread!\n");
+				ring_event_cancel(&sv->not_empty);
+				pthread_exit(NULL);
+			}
+
+			// Nothing to do for a while, the pool might not need us
+			if (sv->min_threads == sv->nr_threads)
+			{
+				ring_event_wait(&sv->not_empty, seen);
+			}
+			else if (!ring_event_timedwait(&sv->not_empty, seen, sv->idle_ns) && worker_retire(self))
+			{
+				pthread_exit(NULL);
+			}
+		}
+
+		for (int i = 0; i < nr_requests; i++)
+		{
+			struct work_item *current_request = &batch[i];
+
+			// Nobody can steal what's in our batch, so if someone ran out
+			// of work they get the rest instead of waiting behind this one
+			if (i > 0 && atomic_load(&sv->not_empty.waiters) > 0)
+			{
+				nr_requests = i + worker_give_back(self, current_request, nr_requests - i);
+				if (i == nr_requests)
+				{
+					break;
+				}
+			}
+
+			// A request stays counted until it's taken out of the batch, so
+			// handing some back can't let server_request go over max_requests.
+			// There's room for one more now, let it know if it's waiting
+			atomic_fetch_sub(&sv->queued, 1);
+			ring_event_signal(&sv->not_full, 1);
+
+			long start = now_ns();
+
+			histogram_record(&thread_stats->queue_wait, start - current_request->queued_at);
+
+			// Waited so long the client has likely given up, don't spend
+			// any more time on it than a 503
+			if (sv->deadline_ns > 0 && start - current_request->queued_at > sv->deadline_ns)
+			{
+				STAT_ADD(thread_stats->expired, 1);
+				if (current_request->conn != NULL)
+				{
+					current_request->conn->fetched = FETCH_OVERLOADED;
+					event_loop_push(current_request->conn->loop, &current_request->conn->loop->finished, current_request->conn);
+				}
+				else
+				{
+					server_reject(current_request->connfd);
+				}
+				continue;
+			}
+
+			// Finnaly do the actual request, or just the file
+			// read if an event loop is doing the rest
+			if (current_request->conn != NULL)
+			{
+				event_fetch(sv, current_request->conn);
+			}
+			else
+			{
+				do_server_request(sv, current_request->connfd);
+			}
+
+			// Keep the service time average (1/8 weight on the newest),
+			// racing with other workers just loses a sample
+			long service = atomic_load_explicit(&sv->service_ns, memory_order_relaxed);
+			service += (now_ns() - start - service) / 8;
+			atomic_store_explicit(&sv->service_ns, service, memory_order_relaxed);
+		}
+		STAT_ADD(thread_stats->batches, 1);
+		STAT_ADD(thread_stats->batched_requests, nr_requests);
+	}
+}
+
+// Start another worker if the last request queued would have to wait
+// longer than target_wait_ns, going by how long requests take
+void pool_maybe_grow(struct server *sv)
+{
+	int active = atomic_load(&sv->active);
+
+	// Someone idle will pick it up
+	if (active >= sv->nr_threads || atomic_load(&sv->not_empty.waiters) > 0)
+	{
+		return;
+	}
+
+	long service = atomic_load_explicit(&sv->service_ns, memory_order_relaxed);
+	long queued = atomic_load(&sv->queued);
+	if (service > 0 ? queued * service / active < sv->target_wait_ns : queued <= active)
+	{
+		return;
+	}
+
+	// Whoever has the lock is already starting one
+	if (pthread_mutex_trylock(&sv->pool_lock) != 0)
+	{
+		return;
+	}
+
+	// Claim the next slot first, a worker retiring at the same time
+	// either beats us to it or sees it can't retire
+	active = atomic_load(&sv->active);
+	while (active < sv->nr_threads && atomic_load(&sv->exiting) == 0)
+	{
+		if (atomic_compare_exchange_weak(&sv->active, &active, active + 1))
+		{
+			worker_start(sv, active);
+			atomic_fetch_add_explicit(&sv->threads_started, 1, memory_order_relaxed);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sv->pool_lock);
+}
+
+// Start a worker in slot id, if it's been used before its last
+// thread retired and just needs to be joined
+void worker_start(struct server *sv, int id)
+{
+	struct worker *worker = &sv->workers[id];
+
+	if (worker->started)
+	{
+		pthread_join(worker->thread, NULL);
+	}
+	worker->started = true;
+
+	// Init each thread by having them go to the stub function until a request
+	// has been parsed where they can then send all the info...
+	// Whoever grows the pool may not have SIGUSR1 blocked
+	pthread_attr_t attr;
+	sigset_t old_mask;
+	pthread_attr_init(&attr);
+	thread_place(sv, &attr, worker->node, id / sv->nr_nodes);
+	stats_signal_block(sv, &old_mask);
+	pthread_create(&worker->thread, &attr, (void *)&stub_function, worker);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+// Leave the pool if we're the last running worker and there's more than the
+// minimum running. Anything left in our queue gets stolen by the others
+bool worker_retire(struct worker *self)
+{
+	struct server *sv = self->sv;
+	int active = self->id + 1;
+
+	if (active <= sv->min_threads || !atomic_compare_exchange_strong(&sv->active, &active, self->id))
+	{
+		return false;
+	}
+
+	atomic_fetch_add_explicit(&sv->threads_retired, 1, memory_order_relaxed);
+	if (atomic_load(&sv->queued) > 0)
+	{
+		ring_event_signal(&sv->not_empty, 1);
+	}
+	return true;
+}
+
+// Where a thread on nodes[node] runs, all of the node's cpus or just one
+// of them picked by slot when pinning to cores. slot is -1 for threads
+// that shouldn't be pinned
+void thread_place(struct server *sv, pthread_attr_t *attr, int node, int slot)
+{
+	cpu_set_t cpus;
+
+	if (sv->affinity == AFFINITY_NONE || sv->nodes[node].nr_cpus == 0)
+	{
+		return;
+	}
+	if (sv->affinity == AFFINITY_NODE || slot < 0)
+	{
+		pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &sv->nodes[node].cpus);
+		return;
+	}
+
+	// The slot'th cpu on the node, going around again if there are more threads
+	slot %= sv->nodes[node].nr_cpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &sv->nodes[node].cpus) && slot-- == 0)
+		{
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu, &cpus);
+			pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &cpus);
+			return;
+		}
+	}
+}
+
+// Read a sysfs list like 0-3,8,10-11 into a set, returns false if it's not there
+static bool
+numa_read_list(const char *path, cpu_set_t *set)
+{
+	FILE *file = fopen(path, "r");
+	int first, last;
+
+	CPU_ZERO(set);
+	if (file == NULL)
+	{
+		return false;
+	}
+	while (fscanf(file, "%d", &first) == 1)
+	{
+		int sep = fgetc(file);
+
+		last = first;
+		if (sep == '-')
+		{
+			if (fscanf(file, "%d", &last) != 1)
+			{
+				break;
+			}
+			sep = fgetc(file);
+		}
+		for (int i = first; i <= last && i < CPU_SETSIZE; i++)
+		{
+			CPU_SET(i, set);
+		}
+		if (sep != ',')
+		{
+			break;
+		}
+	}
+	fclose(file);
+	return true;
+}
+
+// Find the NUMA nodes with cpus we're allowed to run on from sysfs.
+// Without it everything is one node we don't know the id of
+void numa_discover(struct server *sv)
+{
+	cpu_set_t allowed, online;
+	char path[64];
+
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	sv->nodes = (struct numa_node *)Malloc(sizeof(struct numa_node));
+	sv->nr_nodes = 0;
+
+	if (numa_read_list("/sys/devices/system/node/online", &online))
+	{
+		for (int id = 0; id < NUMA_MAX_NODES && id < CPU_SETSIZE; id++)
+		{
+			struct numa_node node = {.id = id};
+
+			if (!CPU_ISSET(id, &online))
+			{
+				continue;
+			}
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+			numa_read_list(path, &node.cpus);
+			CPU_AND(&node.cpus, &node.cpus, &allowed);
+			node.nr_cpus = CPU_COUNT(&node.cpus);
+
+			// Memory only nodes and ones outside our cpuset have nowhere to run
+			if (node.nr_cpus > 0)
+			{
+				sv->nodes = (struct numa_node *)realloc(sv->nodes, sizeof(struct numa_node) * (sv->nr_nodes + 1));
+				sv->nodes[sv->nr_nodes++] = node;
+			}
+		}
+	}
+
+	if (sv->nr_nodes == 0)
+	{
+		sv->nodes[0].id = -1;
+		sv->nodes[0].cpus = allowed;
+		sv->nodes[0].nr_cpus = CPU_COUNT(&allowed);
+		sv->nr_nodes = 1;
+	}
+}
+
+// Take a batch of requests from our own queue, or steal one from a peer
+// if ours is empty. Returns how many were taken. A batch is never more
+// than our share of what's queued so idle workers still get some, and
+// is just one request while any of them are waiting for work
+int worker_next_batch(struct worker *self, struct work_item *items)
+{
+	struct server *sv = self->sv;
+	int max = atomic_load(&sv->queued) / atomic_load(&sv->active) + 1;
+	int nr_requests;
+
+	// One at a time so nobody sits on a request a smaller one should beat
+	if (sv->sjf)
+	{
+		return scheduler_pop(sv, items) ? 1 : 0;
+	}
+	if (max > sv->batch_size)
+	{
+		max = sv->batch_size;
+	}
+	if (atomic_load(&sv->not_empty.waiters) > 0)
+	{
+		max = 1;
+	}
+	if ((nr_requests = ring_pop_batch(&self->queue, items, max)) > 0)
+	{
+		return nr_requests;
+	}
+
+	// Peers on our own node go first so their files stay node local
+	for (int pass = 0; pass < (sv->nr_nodes > 1 ? 2 : 1); pass++)
+	{
+		for (int i = 1; i < sv->nr_threads; i++)
+		{
+			struct worker *victim = &sv->workers[(self->id + i) % sv->nr_threads];
+
+			if ((victim->node == self->node) == (pass == 0) && ring_pop(&victim->queue, items))
+			{
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Put the rest of a batch back on our queue where idle peers can steal it,
+// in the same order. They were never taken off queued so they aren't counted
+// again. Whatever doesn't fit is kept and moved to the front of items,
+// returns how many that is
+int worker_give_back(struct worker *self, struct work_item *items, int nr_items)
+{
+	struct server *sv = self->sv;
+	int given = 0;
+
+	while (given < nr_items && ring_push(&self->queue, &items[given]))
+	{
+		given++;
+	}
+	if (given > 0)
+	{
+		ring_event_signal(&sv->not_empty, given);
+		memmove(items, items + given, sizeof(struct work_item) * (nr_items - given));
+	}
+	return nr_items - given;
+}
+
+// How many bytes a request for file_name should send going by the cache,
+// 0 for a file known to be missing and -1 when there's no telling. Only
+// looks, the replacement policy doesn't count it as a hit
+long scheduler_estimate(struct server *sv, char *file_name)
+{
+	long size = -1;
+
+	if (sv->max_cache_size <= 0 || file_name == NULL || *file_name == '\0')
+	{
+		return size;
+	}
+
+	unsigned long hash = hash_string(file_name);
+	struct wc *shard = cache_shard(sv, hash);
+
+	shard_lock(sv, shard);
+	struct wc_item *cached_file = cache_find(shard, file_name, hash);
+	if (cached_file != NULL && !cached_file->loading)
+	{
+		size = cached_file->data->file_size;
+	}
+	else if (cached_file == NULL && negative_find(shard, file_name, hash))
+	{
+		size = 0;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return size;
+}
+
+// Add a request to the shortest job first heap, admission makes sure there's room
+void scheduler_push(struct server *sv, const struct work_item *item)
+{
+	pthread_mutex_lock(&sv->sjf_lock);
+
+	// Sift up from the end
+	int i = sv->sjf_count++;
+	while (i > 0 && sv->sjf_heap[(i - 1) / 2].key > item->key)
+	{
+		sv->sjf_heap[i] = sv->sjf_heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	sv->sjf_heap[i] = *item;
+
+	pthread_mutex_unlock(&sv->sjf_lock);
+}
+
+// Take the request with the smallest key, returns false if there are none
+bool scheduler_pop(struct server *sv, struct work_item *item)
+{
+	pthread_mutex_lock(&sv->sjf_lock);
+	if (sv->sjf_count == 0)
+	{
+		pthread_mutex_unlock(&sv->sjf_lock);
+		return false;
+	}
+
+	// Sift the last one down from the top
+	*item = sv->sjf_heap[0];
+	struct work_item last = sv->sjf_heap[--sv->sjf_count];
+	int i = 0;
+	while (true)
+	{
+		int child = i * 2 + 1;
+
+		if (child >= sv->sjf_count)
+		{
+			break;
+		}
+		if (child + 1 < sv->sjf_count && sv->sjf_heap[child + 1].key < sv->sjf_heap[child].key)
+		{
+			child++;
+		}
+		if (sv->sjf_heap[child].key >= last.key)
+		{
+			break;
+		}
+		sv->sjf_heap[i] = sv->sjf_heap[child];
+		i = child;
+	}
+	sv->sjf_heap[i] = last;
+
+	pthread_mutex_unlock(&sv->sjf_lock);
+	return true;
+}
+
+// Hand a new connection to the next event loop, round robin
+void event_loop_add(struct server *sv, int connfd)
+{
+	struct event_loop *loop = &sv->loops[atomic_fetch_add_explicit(&sv->next_loop, 1, memory_order_relaxed) % sv->nr_loops];
+	struct connection *conn = (struct connection *)Malloc(sizeof(struct connection));
+
+	fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+	conn->fd = connfd;
+	conn->state = CONN_READING;
+	conn->loop = loop;
+	conn->request[0] = '\0';
+	conn->request_len = 0;
+	conn->request_end = 0;
+	conn->keep_alive = false;
+	conn->served = 0;
+	conn->idle_since = 0;
+	conn->data.file_name = NULL;
+	conn->data.file_buf = NULL;
+	conn->data.file_size = 0;
+	conn->cached = NULL;
+	conn->file_fd = -1;
+	conn->loading = NULL;
+	conn->parked_on = NULL;
+	conn->read_done = 0;
+	conn->header_len = 0;
+	conn->body = NULL;
+	conn->body_len = 0;
+	conn->sent = 0;
+	conn->start = 0;
+	event_loop_push(loop, &loop->incoming, conn);
+}
+
+// Push a connection onto one of a loop's stacks and wake the loop up
+void event_loop_push(struct event_loop *loop, _Atomic(struct connection *) *stack, struct connection *conn)
+{
+	struct connection *head = atomic_load_explicit(stack, memory_order_relaxed);
+
+	do
+	{
+		conn->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(stack, &head, conn, memory_order_release, memory_order_relaxed));
+
+	eventfd_write(loop->wakefd, 1);
+}
+
+// Take everything off one of the loop's stacks, oldest first
+static struct connection *
+event_loop_take(_Atomic(struct connection *) *stack)
+{
+	struct connection *conn = atomic_exchange_explicit(stack, NULL, memory_order_acquire);
+	struct connection *oldest = NULL;
+
+	while (conn != NULL)
+	{
+		struct connection *next = conn->next;
+
+		conn->next = oldest;
+		oldest = conn;
+		conn = next;
+	}
+	return oldest;
+}
+
+// Read the file for a connection on a worker and give it back to its loop
+void event_fetch(struct server *sv, struct connection *conn)
+{
+	conn->fetched = server_fetch(sv, &conn->data, &conn->cached, &conn->file_fd);
+	event_loop_push(conn->loop, &conn->loop->finished, conn);
+}
+
+// Queue a file read for a worker without ever blocking the loop,
+// returns false if max_requests reads are already queued
+static bool
+event_dispatch(struct server *sv, struct connection *conn)
+{
+	int queued = atomic_load(&sv->queued);
+
+	do
+	{
+		if (queued >= sv->max_requests)
+		{
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak(&sv->queued, &queued, queued + 1));
+
+	long now = now_ns();
+	struct work_item item = {conn->fd, now, conn, now};
+	if (sv->sjf)
+	{
+		item.key = scheduler_key(sv, conn->data.file_name, now);
+		scheduler_push(sv, &item);
+	}
+	else
+	{
+		unsigned int next = atomic_fetch_add_explicit(&sv->next_worker, 1, memory_order_relaxed);
+		while (!ring_push(&worker_for(sv, conn->data.file_name, next)->queue, &item))
+		{
+			next++;
+		}
+	}
+	ring_event_signal(&sv->not_empty, 1);
+	STAT_ADD(stats_self(sv)->enqueued, 1);
+	pool_maybe_grow(sv);
+	return true;
+}
+
+// Change what the loop waits for on a connection, it isn't watched
+// at all while a worker reads its file
+static void
+event_watch(struct connection *conn, unsigned int events)
+{
+	struct epoll_event event = {.events = events, .data.ptr = conn};
+
+	if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->fd, &event) < 0 && errno == ENOENT)
+	{
+		epoll_ctl(conn->loop->epfd, EPOLL_CTL_ADD, conn->fd, &event);
+	}
+}
+
+// Start waiting for a connection's next request, the idle list stays
+// in order since everyone waits the same amount of time
+static void
+event_idle_add(struct connection *conn)
+{
+	struct event_loop *loop = conn->loop;
+
+	conn->idle_since = now_ns();
+	conn->idle_prev = loop->idle_tail;
+	conn->idle_next = NULL;
+	if (loop->idle_tail != NULL)
+	{
+		loop->idle_tail->idle_next = conn;
+	}
+	else
+	{
+		loop->idle_head = conn;
+	}
+	loop->idle_tail = conn;
+}
+
+static void
+event_idle_remove(struct connection *conn)
+{
+	struct event_loop *loop = conn->loop;
+
+	if (conn->idle_since == 0)
+	{
+		return;
+	}
+	if (conn->idle_prev != NULL)
+	{
+		conn->idle_prev->idle_next = conn->idle_next;
+	}
+	else
+	{
+		loop->idle_head = conn->idle_next;
+	}
+	if (conn->idle_next != NULL)
+	{
+		conn->idle_next->idle_prev = conn->idle_prev;
+	}
+	else
+	{
+		loop->idle_tail = conn->idle_prev;
+	}
+	conn->idle_since = 0;
+}
+
+// How long the first request in the buffer is up to the blank line
+// ending it, 0 if it isn't all there yet
+static size_t
+event_request_end(struct connection *conn)
+{
+	char *crlf = strstr(conn->request, "\r\n\r\n");
+	char *lf = strstr(conn->request, "\n\n");
+
+	if (crlf != NULL && (lf == NULL || crlf + 4 <= lf + 2))
+	{
+		return crlf + 4 - conn->request;
+	}
+	if (lf != NULL)
+	{
+		return lf + 2 - conn->request;
+	}
+	return 0;
+}
+
+// Count a response that's been sent, or given up on, and let go of what
+// it was sent from
+static void
+event_response_done(struct server *sv, struct connection *conn)
+{
+	struct server_stats *stats = stats_self(sv);
+
+	histogram_record(&stats->send_time, now_ns() - conn->start);
+	STAT_ADD(stats->bytes_served, conn->sent > conn->header_len ? conn->sent - conn->header_len : 0);
+	if (conn->fetched == FETCH_CACHED || conn->fetched == FETCH_COPY)
+	{
+		server_fetch_done(sv, &conn->data, conn->cached);
+	}
+}
+
+// Done with a connection, whatever state it's in
+static void
+event_close(struct server *sv, struct connection *conn)
+{
+	struct event_loop *loop = conn->loop;
+
+	if (conn->state == CONN_WRITING)
+	{
+		event_response_done(sv, conn);
+	}
+	event_idle_remove(conn);
+	if (conn->file_fd >= 0)
+	{
+		close(conn->file_fd);
+	}
+	close(conn->fd);
+	free(conn->data.file_name);
+
+	if (conn->conn_prev != NULL)
+	{
+		conn->conn_prev->conn_next = conn->conn_next;
+	}
+	else
+	{
+		loop->connections = conn->conn_next;
+	}
+	if (conn->conn_next != NULL)
+	{
+		conn->conn_next->conn_prev = conn->conn_prev;
+	}
+	loop->nr_connections--;
+	free(conn);
+}
+
+// Read what the client has sent so far, returns 1 once the whole request
+// is in, 0 if we have to wait for more and -1 if the client went away
+static int
+event_read(struct connection *conn)
+{
+	while (true)
+	{
+		if (conn->request_len == sizeof(conn->request) - 1)
+		{
+			return -1;
+		}
+
+		ssize_t ret = read(conn->fd, conn->request + conn->request_len, sizeof(conn->request) - 1 - conn->request_len);
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return 0;
+		}
+		if (ret <= 0)
+		{
+			return -1;
+		}
+
+		conn->request_len += ret;
+		conn->request[conn->request_len] = '\0';
+		if (event_request_end(conn) > 0)
+		{
+			return 1;
+		}
+	}
+}
+
+// Send as much of the response as the socket takes, returns 1 once it's
+// all gone, 0 if we have to wait for the socket and -1 if the client went away
+static int
+event_write(struct connection *conn)
+{
+	size_t total = conn->header_len + conn->body_len;
+
+	while (conn->sent < total)
+	{
+		ssize_t ret;
+
+		if (conn->file_fd < 0 || conn->sent < conn->header_len)
+		{
+			struct iovec iov[2];
+			int nr_iov = 0;
+			size_t body_sent = 0;
+
+			if (conn->sent < conn->header_len)
+			{
+				iov[nr_iov].iov_base = conn->header + conn->sent;
+				iov[nr_iov].iov_len = conn->header_len - conn->sent;
+				nr_iov++;
+			}
+			else
+			{
+				body_sent = conn->sent - conn->header_len;
+			}
+			if (conn->body != NULL)
+			{
+				iov[nr_iov].iov_base = (char *)conn->body + body_sent;
+				iov[nr_iov].iov_len = conn->body_len - body_sent;
+				nr_iov++;
+			}
+			ret = writev(conn->fd, iov, nr_iov);
+		}
+		else
+		{
+			off_t offset = conn->sent - conn->header_len;
+			ret = sendfile(conn->fd, conn->file_fd, &offset, total - conn->sent);
+		}
+
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return 0;
+		}
+		if (ret <= 0)
+		{
+			return -1;
+		}
+		conn->sent += ret;
+	}
+	return 1;
+}
+
+// The response is all sent and the connection stays open, get ready for
+// the next request. If the client already sent it (pipelining) it's
+// answered on the loop's next time around, otherwise we wait for it
+static void
+event_next_request(struct server *sv, struct connection *conn)
+{
+	event_response_done(sv, conn);
+	if (conn->file_fd >= 0)
+	{
+		close(conn->file_fd);
+		conn->file_fd = -1;
+	}
+	free(conn->data.file_name);
+	conn->data.file_name = NULL;
+	conn->data.file_buf = NULL;
+	conn->data.file_size = 0;
+	conn->cached = NULL;
+	conn->read_done = 0;
+	conn->header_len = 0;
+	conn->body = NULL;
+	conn->body_len = 0;
+	conn->sent = 0;
+	conn->state = CONN_READING;
+
+	// Whatever came in after the request is the start of the next one
+	conn->request_len -= conn->request_end;
+	memmove(conn->request, conn->request + conn->request_end, conn->request_len + 1);
+	conn->request_end = 0;
+
+	if (event_request_end(conn) > 0)
+	{
+		epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+		conn->next = conn->loop->pipelined;
+		conn->loop->pipelined = conn;
+	}
+	else
+	{
+		event_idle_add(conn);
+		event_watch(conn, EPOLLIN);
+	}
+}
+
+// Write as much as we can now, the rest when the socket has room
+static void
+event_send(struct server *sv, struct connection *conn)
+{
+	int ret = event_write(conn);
+
+	if (ret == 0)
+	{
+		event_watch(conn, EPOLLOUT);
+	}
+	else if (ret == 1 && conn->keep_alive)
+	{
+		event_next_request(sv, conn);
+	}
+	else
+	{
+		event_close(sv, conn);
+	}
+}
+
+// Start answering with the Tiny style error page that's len bytes of conn->header,
+// the page says if the connection stays open and that has to match conn->keep_alive
+static void
+event_error(struct server *sv, struct connection *conn, int len)
+{
+	conn->header_len = len;
+	conn->state = CONN_WRITING;
+	conn->fetched = FETCH_FAILED;
+	conn->start = now_ns();
+	event_send(sv, conn);
+}
+
+// A worker is done with the file, start sending it
+static void
+event_respond(struct server *sv, struct connection *conn)
+{
+	struct file_data *data = conn->cached != NULL ? conn->cached->data : &conn->data;
+
+	switch (conn->fetched)
+	{
+	case FETCH_MISSING:
+	case FETCH_NEGATIVE:
+	case FETCH_FORBIDDEN:
+	case FETCH_FAILED:
+	case FETCH_OVERLOADED:
+		if (conn->fetched == FETCH_OVERLOADED)
+		{
+			conn->keep_alive = false;
+		}
+		event_error(sv, conn, fetch_error_response(conn->header, sizeof(conn->header), conn->fetched,
+												   conn->data.file_name, conn->keep_alive));
+		return;
+	case FETCH_STREAM:
+		break;
+	case FETCH_CACHED:
+	case FETCH_COPY:
+		conn->body = data->file_buf;
+		break;
+	}
+
+	// A cached file's header only needs its end, which depends on the connection
+	if (conn->fetched == FETCH_CACHED)
+	{
+		const char *end = response_header_end(conn->keep_alive);
+
+		memcpy(conn->header, conn->cached->header, conn->cached->header_len);
+		strcpy(conn->header + conn->cached->header_len, end);
+		conn->header_len = conn->cached->header_len + strlen(end);
+	}
+	else
+	{
+		conn->header_len = response_header(conn->header, sizeof(conn->header), data, conn->keep_alive);
+	}
+	conn->body_len = data->file_size;
+	conn->state = CONN_WRITING;
+	conn->start = now_ns();
+	event_send(sv, conn);
+}
+
+static void event_read_done(struct server *sv, struct connection *conn, int res);
+
+// Queue the rest of a connection's file read on the loop's ring
+static void
+event_read_submit(struct connection *conn)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&conn->loop->ring);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = conn->file_fd;
+	sqe->off = conn->read_done;
+	sqe->addr = (uintptr_t)(conn->data.file_buf + conn->read_done);
+	sqe->len = conn->data.file_size - conn->read_done;
+	sqe->user_data = (uintptr_t)conn;
+}
+
+// Try to fetch the file without a worker: hits are answered right away and
+// misses are read through the loop's ring. Returns false if a worker has to
+// do it because the ring is full
+static bool
+event_fetch_async(struct server *sv, struct connection *conn)
+{
+	struct server_stats *stats = stats_self(sv);
+	struct file_data *data = &conn->data;
+	unsigned long hash = hash_string(data->file_name);
+	struct wc *shard = cache_shard(sv, hash);
+
+	shard_lock(sv, shard);
+
+	// Someone else is reading it in, maybe this loop's ring. Waiting for
+	// them here could wait forever, so the connection is parked on the
+	// placeholder and comes back through finished when they're done
+	struct wc_item *cached_file = cache_find(shard, data->file_name, hash);
+	if (cached_file != NULL && cached_file->loading)
+	{
+		STAT_ADD(stats->coalesced, 1);
+		atomic_fetch_add_explicit(&cached_file->refcount, 1, memory_order_relaxed);
+		conn->parked_on = cached_file;
+		conn->next = cached_file->parked;
+		cached_file->parked = conn;
+		pthread_mutex_unlock(&shard->lock);
+		return true;
+	}
+
+	cached_file = cache_lookup(shard, data->file_name, hash);
+	if (cached_file != NULL)
+	{
+		atomic_fetch_add_explicit(&cached_file->refcount, 1, memory_order_relaxed);
+		bool check = cache_check_due(sv, cached_file);
+		pthread_mutex_unlock(&shard->lock);
+		if (check)
+		{
+			STAT_ADD(stats->revalidations, 1);
+			if (cache_file_changed(cached_file))
+			{
+				cache_invalidate_locked(sv, shard, cached_file);
+				cache_release(cached_file);
+				return event_fetch_async(sv, conn);
+			}
+		}
+		STAT_ADD(stats->hits, 1);
+		conn->cached = cached_file;
+		conn->fetched = FETCH_CACHED;
+		event_respond(sv, conn);
+		return true;
+	}
+
+	if (negative_find(shard, data->file_name, hash))
+	{
+		STAT_ADD(stats->negative_hits, 1);
+		pthread_mutex_unlock(&shard->lock);
+		conn->fetched = FETCH_NEGATIVE;
+		event_respond(sv, conn);
+		return true;
+	}
+
+	if (conn->loop->ring.in_flight + conn->loop->ring.pending >= conn->loop->ring.depth)
+	{
+		pthread_mutex_unlock(&shard->lock);
+		return false;
+	}
+
+	STAT_ADD(stats->misses, 1);
+	conn->loading = cache_reserve(shard, data->file_name, hash);
+	pthread_mutex_unlock(&shard->lock);
+	if (conn->loading != NULL)
+	{
+		cache_watch_add(sv, data->file_name);
+	}
+
+	// Opening is quick next to reading, so it's done right here
+	struct stat st;
+	conn->file_fd = sv->open_file(data, &st);
+	if (conn->file_fd < 0)
+	{
+		conn->fetched = request_openfailed(errno);
+		cache_missing_locked(sv, shard, conn->loading, data->file_name, conn->fetched);
+		conn->loading = NULL;
+		event_respond(sv, conn);
+		return true;
+	}
+	if (conn->loading != NULL)
+	{
+		cache_identify(conn->loading, &st);
+	}
+
+	// Same as server_fetch, stream what won't fit or can't be read in
+	if (arena_charge(data->file_size) > cache_tier_for(shard, data->file_size)->size ||
+		(data->file_buf = arena_alloc(&shard->arena, data->file_size)) == NULL)
+	{
+		cache_abandon_locked(sv, shard, conn->loading);
+		conn->loading = NULL;
+		STAT_ADD(stats->streamed, 1);
+		conn->fetched = FETCH_STREAM;
+		event_respond(sv, conn);
+		return true;
+	}
+
+	STAT_ADD(stats->async_reads, 1);
+	conn->read_done = 0;
+	conn->read_start = now_ns();
+	if (data->file_size > 0)
+	{
+		event_read_submit(conn);
+	}
+	else
+	{
+		event_read_done(sv, conn, 0);
+	}
+	return true;
+}
+
+// A read from the loop's ring finished, res is what read would have returned
+static void
+event_read_done(struct server *sv, struct connection *conn, int res)
+{
+	struct server_stats *stats = stats_self(sv);
+	struct file_data *data = &conn->data;
+	struct wc *shard = cache_shard(sv, hash_string(data->file_name));
+
+	if (res == -EINTR || res == -EAGAIN)
+	{
+		event_read_submit(conn);
+		return;
+	}
+	if (res > 0)
+	{
+		conn->read_done += res;
+		if (conn->read_done < (size_t)data->file_size)
+		{
+			event_read_submit(conn);
+			return;
+		}
+	}
+
+	histogram_record(&stats->read_time, now_ns() - conn->read_start);
+	close(conn->file_fd);
+	conn->file_fd = -1;
+
+	if (conn->read_done < (size_t)data->file_size)
+	{ /* couldn't read file */
+		arena_free(&shard->arena, data->file_buf, data->file_size);
+		data->file_buf = NULL;
+		cache_abandon_locked(sv, shard, conn->loading);
+		conn->fetched = FETCH_FAILED;
+	}
+	else if (conn->loading != NULL)
+	{
+		// Same as server_fetch, the cache takes the buffer if it can
+		shard_lock(sv, shard);
+		int ret = cache_add(shard, conn->loading, data);
+		pthread_mutex_unlock(&shard->lock);
+		if (ret == 1)
+		{
+			data->file_buf = NULL;
+			conn->cached = conn->loading;
+			conn->fetched = FETCH_CACHED;
+		}
+		else
+		{
+			STAT_ADD(stats->insert_failures, 1);
+			conn->fetched = FETCH_COPY;
+		}
+	}
+	else
+	{
+		// There was no room for a placeholder, send our own copy
+		conn->fetched = FETCH_COPY;
+	}
+	conn->loading = NULL;
+	event_respond(sv, conn);
+}
+
+// Hand the file read to a worker, or do it here if there are no workers.
+// When the workers (or without them, the ring) are full up the connection
+// waits on the backlog
+static void
+event_fetch_file(struct server *sv, struct connection *conn)
+{
+	struct event_loop *loop = conn->loop;
+
+	if (loop->ring.fd >= 0 && event_fetch_async(sv, conn))
+	{
+		return;
+	}
+	if (sv->nr_threads == 0 && loop->ring.fd < 0)
+	{
+		conn->fetched = server_fetch(sv, &conn->data, &conn->cached, &conn->file_fd);
+		event_respond(sv, conn);
+	}
+	else if (sv->shed && sv->nr_threads > 0)
+	{
+		// Full, answer now instead of holding on to it
+		if (!event_dispatch(sv, conn))
+		{
+			STAT_ADD(stats_self(sv)->rejected, 1);
+			conn->fetched = FETCH_OVERLOADED;
+			event_respond(sv, conn);
+		}
+	}
+	else if (loop->backlog != NULL || sv->nr_threads == 0 || !event_dispatch(sv, conn))
+	{
+		conn->next = NULL;
+		if (loop->backlog_tail != NULL)
+		{
+			loop->backlog_tail->next = conn;
+		}
+		else
+		{
+			loop->backlog = conn;
+		}
+		loop->backlog_tail = conn;
+	}
+}
+
+// Stop listening to the connection while its file is found
+static void
+event_fetch_start(struct server *sv, struct connection *conn)
+{
+	conn->state = CONN_FETCHING;
+	epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	event_fetch_file(sv, conn);
+}
+
+// Does the request's Connection header list token, going by the header's
+// name at the start of a line and not just any text that looks like it.
+// The request has to be nul terminated after its blank line
+static bool
+event_connection_has(const char *request, const char *token)
+{
+	size_t token_len = strlen(token);
+	const char *line = strchr(request, '\n');
+
+	while (line != NULL)
+	{
+		line++;
+		if (strncasecmp(line, "Connection:", 11) == 0)
+		{
+			// Comma separated tokens up to the end of the line
+			const char *value = line + 11;
+			while (true)
+			{
+				value += strspn(value, " \t,");
+				size_t len = strcspn(value, " \t,\r\n");
+				if (len == 0)
+				{
+					break;
+				}
+				if (len == token_len && strncasecmp(value, token, len) == 0)
+				{
+					return true;
+				}
+				value += len;
+			}
+		}
+		line = strchr(line, '\n');
+	}
+	return false;
+}
+
+// Does the request say a body follows it, either with a length that isn't
+// 0 or with a transfer coding. Nul terminated like for event_connection_has
+static bool
+event_has_body(const char *request)
+{
+	const char *line = strchr(request, '\n');
+
+	while (line != NULL)
+	{
+		line++;
+		if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 ||
+			(strncasecmp(line, "Content-Length:", 15) == 0 && strtol(line + 15, NULL, 10) != 0))
+		{
+			return true;
+		}
+		line = strchr(line, '\n');
+	}
+	return false;
+}
+
+// The whole request is in, work out which file it wants
+static void
+event_parse(struct server *sv, struct connection *conn)
+{
+	char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+	int parsed;
+
+	event_idle_remove(conn);
+	if (conn->served > 0)
+	{
+		STAT_ADD(stats_self(sv)->keepalive_reuses, 1);
+	}
+
+	// Only look at this request, the next one might be right behind it
+	conn->request_end = event_request_end(conn);
+	char next = conn->request[conn->request_end];
+	conn->request[conn->request_end] = '\0';
+	parsed = sscanf(conn->request, "%s %s %s", method, uri, version);
+
+	// HTTP/1.1 stays open unless the client says otherwise, 1.0 only if it asks
+	conn->keep_alive = parsed == 3 && ++conn->served < sv->keepalive_requests && !atomic_load(&sv->loops_exiting) &&
+					   (strcasecmp(version, "HTTP/1.1") == 0 ? !event_connection_has(conn->request, "close")
+															: event_connection_has(conn->request, "keep-alive"));
+
+	// Anything other than a GET gets a 501, but if it came with a body we
+	// never read it so there's no telling where the next request starts
+	if (parsed == 3 && strcasecmp(method, "GET") && event_has_body(conn->request))
+	{
+		conn->keep_alive = false;
+	}
+	conn->request[conn->request_end] = next;
+
+	if (parsed != 3)
+	{
+		event_close(sv, conn);
+		return;
+	}
+	if (strcasecmp(method, "GET"))
+	{
+		event_error(sv, conn, error_response(conn->header, sizeof(conn->header), method, "501", "Not Implemented",
+											 "Tiny does not implement this method", conn->keep_alive));
+		return;
+	}
+
+	// Same file name request_init would come up with
+	conn->data.file_name = Malloc(strlen(uri) + 2);
+	sprintf(conn->data.file_name, ".%s", uri);
+	event_fetch_start(sv, conn);
+}
+
+// Something happened on a connection
+static void
+event_handle(struct server *sv, struct connection *conn)
+{
+	int ret;
+
+	switch (conn->state)
+	{
+	case CONN_READING:
+		ret = event_read(conn);
+		if (ret == 1)
+		{
+			event_parse(sv, conn);
+		}
+		else if (ret < 0)
+		{
+			event_close(sv, conn);
+		}
+		break;
+	case CONN_FETCHING:
+		// Nothing to do until the file is read
+		break;
+	case CONN_WRITING:
+		event_send(sv, conn);
+		break;
+	}
+}
+
+// Event loop threads wait here for connections to do something, all the
+// socket io happens here without blocking and only file reads go to workers
+void event_loop_function(struct event_loop *loop)
+{
+	struct server *sv = loop->sv;
+	struct epoll_event events[EVENT_BATCH];
+
+	thread_stats = &sv->stats[sv->nr_threads + loop->id];
+
+	while (true)
+	{
+		// File reads queued last time around all go in with one syscall
+		if (loop->ring.fd >= 0)
+		{
+			uring_submit(&loop->ring);
+		}
+
+		// Poll every millisecond while there are reads waiting for room,
+		// and wake up when the longest idle connection runs out of time
+		bool waiting = loop->backlog != NULL || (loop->ring.fd >= 0 && loop->ring.pending > 0);
+		int timeout = waiting ? 1 : -1;
+		if (loop->pipelined != NULL)
+		{
+			timeout = 0;
+		}
+		else if (loop->idle_head != NULL && sv->conn_idle_ns > 0)
+		{
+			long left = (loop->idle_head->idle_since + sv->conn_idle_ns - now_ns()) / 1000000 + 1;
+			if (timeout < 0 || left < timeout)
+			{
+				timeout = left > 0 ? left : 0;
+			}
+		}
+		int nr_events = epoll_wait(loop->epfd, events, EVENT_BATCH, timeout);
+
+		for (int i = 0; i < nr_events; i++)
+		{
+			if (events[i].data.ptr == NULL)
+			{
+				eventfd_t value;
+				eventfd_read(loop->wakefd, &value);
+			}
+			else
+			{
+				event_handle(sv, events[i].data.ptr);
+			}
+		}
+
+		// New connections from server_request
+		struct connection *conn = event_loop_take(&loop->incoming);
+		while (conn != NULL)
+		{
+			struct connection *next = conn->next;
+			struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+
+			conn->conn_prev = NULL;
+			conn->conn_next = loop->connections;
+			if (loop->connections != NULL)
+			{
+				loop->connections->conn_prev = conn;
+			}
+			loop->connections = conn;
+			loop->nr_connections++;
+			epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->fd, &event);
+			event_idle_add(conn);
+
+			// The request is usually there already
+			event_handle(sv, conn);
+			conn = next;
+		}
+
+		// Files the ring is done reading
+		struct io_uring_cqe cqe;
+		while (loop->ring.fd >= 0 && uring_next_cqe(&loop->ring, &cqe))
+		{
+			event_read_done(sv, (struct connection *)(uintptr_t)cqe.user_data, cqe.res);
+		}
+
+		// Files the workers are done reading, and ones connections were
+		// parked on that someone finished loading, which are looked up again
+		conn = event_loop_take(&loop->finished);
+		while (conn != NULL)
+		{
+			struct connection *next = conn->next;
+
+			if (conn->parked_on != NULL)
+			{
+				cache_release(conn->parked_on);
+				conn->parked_on = NULL;
+				event_fetch_file(sv, conn);
+			}
+			else
+			{
+				event_respond(sv, conn);
+			}
+			conn = next;
+		}
+
+		// Pipelined requests that came in with the last one, answering
+		// them can add more for next time around
+		conn = loop->pipelined;
+		loop->pipelined = NULL;
+		while (conn != NULL)
+		{
+			struct connection *next = conn->next;
+
+			STAT_ADD(thread_stats->pipelined, 1);
+			event_parse(sv, conn);
+			conn = next;
+		}
+
+		// Connections that have waited too long for a request
+		long now = now_ns();
+		while (sv->conn_idle_ns > 0 && loop->idle_head != NULL && loop->idle_head->idle_since + sv->conn_idle_ns <= now)
+		{
+			STAT_ADD(thread_stats->idle_closed, 1);
+			event_close(sv, loop->idle_head);
+		}
+
+		// Reads waiting for room in the worker queues (or the ring when
+		// there are no workers), a worker can be done with a connection
+		// (and reuse next) as soon as it's dispatched
+		while (loop->backlog != NULL)
+		{
+			conn = loop->backlog;
+			struct connection *next = conn->next;
+
+			if (sv->nr_threads == 0 ? !event_fetch_async(sv, conn) : !event_dispatch(sv, conn))
+			{
+				break;
+			}
+			loop->backlog = next;
+			if (next == NULL)
+			{
+				loop->backlog_tail = NULL;
+			}
+		}
+
+		// When the server is exiting drop connections that haven't sent a
+		// request yet and finish the rest, pipelined ones included
+		if (atomic_load(&sv->loops_exiting) == 1)
+		{
+			conn = loop->connections;
+			while (conn != NULL)
+			{
+				struct connection *next = conn->conn_next;
+
+				if (conn->state == CONN_READING && event_request_end(conn) == 0)
+				{
+					event_close(sv, conn);
+				}
+				conn = next;
+			}
+			if (loop->nr_connections == 0)
+			{
+				return;
+			}
+		}
+	}
+}
+
+// Set up an io_uring with room for depth reads, returns -1 and leaves
+// ring->fd at -1 if the kernel doesn't have it
+int uring_init(struct uring *ring, unsigned int depth)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (ring->fd < 0)
+	{
+		ring->fd = -1;
+		return -1;
+	}
+
+	// Old kernels map the two rings separately, and before 5.6 they can set
+	// up a ring but fail every IORING_OP_READ, just don't bother with them.
+	// Asking about opcodes is new in 5.6 too, so failing to ask is a no
+	struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	bool can_read = probe != NULL && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) >= 0 &&
+					probe->last_op >= IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !can_read)
+	{
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	char *map = mmap(NULL, ring->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED)
+	{
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		munmap(map, ring->ring_map_size);
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+
+	ring->ring_map = map;
+	ring->sq_head = (unsigned int *)(map + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(map + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(map + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(map + params.sq_off.array);
+	ring->cq_head = (unsigned int *)(map + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(map + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(map + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+	ring->tail = *ring->sq_tail;
+	ring->pending = 0;
+	ring->in_flight = 0;
+	ring->depth = params.sq_entries < depth ? params.sq_entries : depth;
+	return 0;
+}
+
+void uring_destroy(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->ring_map, ring->ring_map_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+// Next free submission entry, zeroed. Callers make sure there's room
+// by keeping pending + in_flight under depth
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned int index = ring->tail++ & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->pending++;
+	return sqe;
+}
+
+// Hand everything queued with uring_get_sqe to the kernel, whatever
+// it doesn't take now stays pending for next time
+void uring_submit(struct uring *ring)
+{
+	if (ring->pending == 0)
+	{
+		return;
+	}
+
+	atomic_store_explicit((_Atomic unsigned int *)ring->sq_tail, ring->tail, memory_order_release);
+	int ret = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 0, 0, NULL, 0);
+	if (ret > 0)
+	{
+		ring->in_flight += ret;
+		ring->pending -= ret;
+	}
+}
+
+// Take the next completion if there is one
+bool uring_next_cqe(struct uring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == atomic_load_explicit((_Atomic unsigned int *)ring->cq_tail, memory_order_acquire))
+	{
+		return false;
+	}
+
+	*cqe = ring->cqes[head & *ring->cq_mask];
+	atomic_store_explicit((_Atomic unsigned int *)ring->cq_head, head + 1, memory_order_release);
+	ring->in_flight--;
+	return true;
+}
+
+// Set up an empty ring, every slot starts out free for the
+// producer whose position maps onto it
+void ring_init(struct request_ring *ring, size_t capacity)
+{
+	ring->capacity = capacity;
+	ring->slots = (struct ring_slot *)malloc(sizeof(struct ring_slot) * capacity);
+	for (size_t i = 0; i < capacity; i++)
+	{
+		atomic_init(&ring->slots[i].seq, 2 * i);
+		ring->slots[i].item.connfd = -1;
+	}
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+// Free the ring, anything still in it is closed
+void ring_destroy(struct request_ring *ring)
+{
+	struct work_item item;
+
+	while (ring_pop(ring, &item))
+	{
+		close(item.connfd);
+	}
+	free(ring->slots);
+}
+
+// Try to add a request, returns false if the ring is full
+bool ring_push(struct request_ring *ring, const struct work_item *item)
+{
+	size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	struct ring_slot *slot;
+
+	while (true)
+	{
+		slot = &ring->slots[pos % ring->capacity];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(2 * pos);
+
+		// Slot is free, claim the position
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+													  memory_order_relaxed, memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		// The consumer from the previous lap hasn't taken it yet so we're full
+		else if (diff < 0)
+		{
+			return false;
+		}
+		// Another producer got here first
+		else
+		{
+			pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		}
+	}
+
+	slot->item = *item;
+	atomic_store_explicit(&slot->seq, 2 * pos + 1, memory_order_release);
+	return true;
+}
+
+// Try to take a request, returns false if the ring is empty
+bool ring_pop(struct request_ring *ring, struct work_item *item)
+{
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct ring_slot *slot;
+
+	while (true)
+	{
+		slot = &ring->slots[pos % ring->capacity];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(2 * pos + 1);
+
+		// Slot is filled, claim the position
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+													  memory_order_relaxed, memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		// The producer hasn't filled it yet so we're empty
+		else if (diff < 0)
+		{
+			return false;
+		}
+		// Another consumer got here first
+		else
+		{
+			pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		}
+	}
+
+	*item = slot->item;
+
+	// Free the slot for the producer one lap ahead
+	atomic_store_explicit(&slot->seq, 2 * (pos + ring->capacity), memory_order_release);
+	return true;
+}
+
+// Take up to max requests that are next to each other in one go, returns
+// how many were taken. Only one compare and swap however many it is
+int ring_pop_batch(struct request_ring *ring, struct work_item *items, int max)
+{
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	int nr_items;
+
+	while (true)
+	{
+		// Count the filled slots in a row from pos
+		for (nr_items = 0; nr_items < max; nr_items++)
+		{
+			struct ring_slot *slot = &ring->slots[(pos + nr_items) % ring->capacity];
+
+			if (atomic_load_explicit(&slot->seq, memory_order_acquire) != 2 * (pos + nr_items) + 1)
+			{
+				break;
+			}
+		}
+
+		// Nothing there, unless another consumer moved head on us
+		if (nr_items == 0)
+		{
+			size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+			if (head == pos)
+			{
+				return 0;
+			}
+			pos = head;
+			continue;
+		}
+
+		if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + nr_items,
+												  memory_order_relaxed, memory_order_relaxed))
+		{
+			break;
+		}
+	}
+
+	for (int i = 0; i < nr_items; i++)
+	{
+		struct ring_slot *slot = &ring->slots[(pos + i) % ring->capacity];
+
+		items[i] = slot->item;
+
+		// Free the slot for the producer one lap ahead
+		atomic_store_explicit(&slot->seq, 2 * (pos + i + ring->capacity), memory_order_release);
+	}
+	return nr_items;
+}
+
+// Register as a waiter on the event, the caller has to check its condition
+// again afterwards and then either wait or cancel so a signal can't slip
+// in between the check and parking
+unsigned int ring_event_prepare(struct ring_event *event)
+{
+	atomic_fetch_add(&event->waiters, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	return atomic_load(&event->seq);
+}
+
+// Park until the event is signalled after seen was read
+void ring_event_wait(struct ring_event *event, unsigned int seen)
+{
+	syscall(SYS_futex, &event->seq, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+	atomic_fetch_sub(&event->waiters, 1);
+}
+
+// Same as ring_event_wait but gives up after timeout_ns,
+// returns false if that's why it woke up
+bool ring_event_timedwait(struct ring_event *event, unsigned int seen, long timeout_ns)
+{
+	struct timespec timeout = {timeout_ns / 1000000000l, timeout_ns % 1000000000l};
+	long ret = syscall(SYS_futex, &event->seq, FUTEX_WAIT_PRIVATE, seen, &timeout, NULL, 0);
+	bool timed_out = ret < 0 && errno == ETIMEDOUT;
+
+	atomic_fetch_sub(&event->waiters, 1);
+	return !timed_out;
+}
+
+// Don't wait after all
+void ring_event_cancel(struct ring_event *event)
+{
+	atomic_fetch_sub(&event->waiters, 1);
+}
+
+// Wake up to nr_wake threads parked on the event, this is just
+// a load when nobody is waiting
+void ring_event_signal(struct ring_event *event, int nr_wake)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&event->waiters) > 0)
+	{
+		atomic_fetch_add(&event->seq, 1);
+		syscall(SYS_futex, &event->seq, FUTEX_WAKE_PRIVATE, nr_wake, NULL, NULL, 0);
+	}
+}
+
+// Put a latency in its bucket, STAT_ADD takes care of histograms in the shared set
+void histogram_record(struct histogram *histogram, long value)
+{
+	unsigned long v = value > 0 ? value : 0;
+	int bucket = v;
+
+	if (v >= (1ul << HISTOGRAM_SUB_BITS))
+	{
+		int msb = 63 - __builtin_clzl(v);
+		int shift = msb - HISTOGRAM_SUB_BITS;
+		bucket = ((shift + 1) << HISTOGRAM_SUB_BITS) + ((v >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+	}
+
+	STAT_ADD(histogram->counts[bucket], 1);
+	STAT_ADD(histogram->total, 1);
+	STAT_ADD(histogram->sum, v);
+	unsigned long max = STAT_READ(histogram->max);
+	while (v > max && !atomic_compare_exchange_weak_explicit((_Atomic unsigned long *)&histogram->max, &max, v,
+															  memory_order_relaxed, memory_order_relaxed))
+	{
+	}
+}
+
+// Smallest value that lands in a bucket
+static unsigned long
+histogram_bucket_value(int bucket)
+{
+	if (bucket < (1 << HISTOGRAM_SUB_BITS))
+	{
+		return bucket;
+	}
+
+	int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+	unsigned long sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+	return ((1ul << HISTOGRAM_SUB_BITS) | sub) << shift;
+}
+
+static unsigned long
+histogram_percentile(struct histogram *histogram, double percentile)
+{
+	unsigned long wanted = histogram->total * percentile / 100.0;
+	unsigned long seen = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += histogram->counts[i];
+		if (seen > wanted)
+		{
+			return histogram_bucket_value(i);
+		}
+	}
+	return histogram->max;
+}
+
+static void
+histogram_dump(FILE *out, const char *name, struct histogram *histogram)
+{
+	fprintf(out, "%-12s count %lu mean %luus p50 %luus p90 %luus p99 %luus p99.9 %luus max %luus\n",
+			name, histogram->total,
+			histogram->total > 0 ? histogram->sum / histogram->total / 1000 : 0,
+			histogram_percentile(histogram, 50) / 1000,
+			histogram_percentile(histogram, 90) / 1000,
+			histogram_percentile(histogram, 99) / 1000,
+			histogram_percentile(histogram, 99.9) / 1000,
+			histogram->max / 1000);
+}
+
+static void
+histogram_add(struct histogram *total, struct histogram *histogram)
+{
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		total->counts[i] += STAT_READ(histogram->counts[i]);
+	}
+	total->total += STAT_READ(histogram->total);
+	total->sum += STAT_READ(histogram->sum);
+	unsigned long max = STAT_READ(histogram->max);
+	if (max > total->max)
+	{
+		total->max = max;
+	}
+}
+
+// Add up everybody's counters and print them, safe to call at any time
+// from the thread that owns the server
+void server_stats_dump(struct server *sv, FILE *out)
+{
+	struct server_stats *total = (struct server_stats *)calloc(1, sizeof(struct server_stats));
+	unsigned long evictions = 0;
+	unsigned long invalidations = 0;
+	unsigned long negative_count = 0;
+	long bytes_cached = 0;
+	long tier_count[CACHE_TIERS] = {0};
+	long tier_size[CACHE_TIERS] = {0};
+	unsigned long tier_evictions[CACHE_TIERS] = {0};
+	long slab_bytes = 0;
+	long large_bytes = 0;
+	long pooled_bytes = 0;
+
+	for (int i = 0; i <= sv->nr_threads + sv->nr_loops; i++)
+	{
+		struct server_stats *stats = &sv->stats[i];
+
+		total->hits += STAT_READ(stats->hits);
+		total->misses += STAT_READ(stats->misses);
+		total->insert_failures += STAT_READ(stats->insert_failures);
+		total->coalesced += STAT_READ(stats->coalesced);
+		total->streamed += STAT_READ(stats->streamed);
+		total->async_reads += STAT_READ(stats->async_reads);
+		total->revalidations += STAT_READ(stats->revalidations);
+		total->negative_hits += STAT_READ(stats->negative_hits);
+		total->negative_inserts += STAT_READ(stats->negative_inserts);
+		total->enqueued += STAT_READ(stats->enqueued);
+		total->rejected += STAT_READ(stats->rejected);
+		total->expired += STAT_READ(stats->expired);
+		total->keepalive_reuses += STAT_READ(stats->keepalive_reuses);
+		total->pipelined += STAT_READ(stats->pipelined);
+		total->idle_closed += STAT_READ(stats->idle_closed);
+		total->sjf_known += STAT_READ(stats->sjf_known);
+		total->sjf_guessed += STAT_READ(stats->sjf_guessed);
+		total->bytes_served += STAT_READ(stats->bytes_served);
+		total->cache_lock_waits += STAT_READ(stats->cache_lock_waits);
+		total->cache_lock_wait_ns += STAT_READ(stats->cache_lock_wait_ns);
+		total->admission_waits += STAT_READ(stats->admission_waits);
+		total->admission_wait_ns += STAT_READ(stats->admission_wait_ns);
+		total->batches += STAT_READ(stats->batches);
+		total->batched_requests += STAT_READ(stats->batched_requests);
+		histogram_add(&total->queue_wait, &stats->queue_wait);
+		histogram_add(&total->read_time, &stats->read_time);
+		histogram_add(&total->send_time, &stats->send_time);
+	}
+
+	// Each shard is only held long enough to copy a few numbers out
+	for (int i = 0; i < sv->nr_shards; i++)
+	{
+		pthread_mutex_lock(&sv->cache[i].lock);
+		for (int j = 0; j < CACHE_TIERS; j++)
+		{
+			tier_count[j] += sv->cache[i].tiers[j].count;
+			tier_size[j] += sv->cache[i].tiers[j].size;
+			tier_evictions[j] += sv->cache[i].tiers[j].evictions;
+			evictions += sv->cache[i].tiers[j].evictions;
+			bytes_cached += sv->cache[i].tiers[j].count;
+		}
+		invalidations += sv->cache[i].invalidations;
+		negative_count += sv->cache[i].negative_count;
+		pthread_mutex_lock(&sv->cache[i].arena.lock);
+		slab_bytes += sv->cache[i].arena.slab_bytes;
+		large_bytes += sv->cache[i].arena.large_bytes;
+		pooled_bytes += sv->cache[i].arena.pooled_bytes;
+		pthread_mutex_unlock(&sv->cache[i].arena.lock);
+		pthread_mutex_unlock(&sv->cache[i].lock);
+	}
+
+	fprintf(out, "policy %s shards %d threads %d event_loops %d affinity %s nodes %d\n",
+			sv->policy != NULL ? sv->policy->name : "none", sv->nr_shards, sv->nr_threads, sv->nr_loops,
+			sv->affinity == AFFINITY_CORE ? "core" : sv->affinity == AFFINITY_NODE ? "node" : "none", sv->nr_nodes);
+	fprintf(out, "hits %lu misses %lu coalesced %lu insert_failures %lu streamed %lu async_reads %lu evictions %lu\n",
+			total->hits, total->misses, total->coalesced, total->insert_failures, total->streamed,
+			total->async_reads, evictions);
+	fprintf(out, "bytes_served %lu bytes_cached %ld of %d queue_depth %d of %d\n",
+			total->bytes_served, bytes_cached, sv->max_cache_size,
+			atomic_load(&sv->queued), sv->max_requests);
+	if (sv->nr_shards > 0)
+	{
+		fprintf(out, "small_tier %ld of %ld evictions %lu (up to %ldB) large_tier %ld of %ld evictions %lu\n",
+				tier_count[TIER_SMALL], tier_size[TIER_SMALL], tier_evictions[TIER_SMALL], sv->cache[0].small_max,
+				tier_count[TIER_LARGE], tier_size[TIER_LARGE], tier_evictions[TIER_LARGE]);
+	}
+	fprintf(out, "arena_slab_bytes %ld arena_large_bytes %ld (pooled %ld)\n", slab_bytes, large_bytes, pooled_bytes);
+	fprintf(out, "pool active %d min %d max %d started %lu retired %lu service %ldus batch %d avg_batch %.2f\n",
+			atomic_load(&sv->active), sv->min_threads, sv->nr_threads,
+			atomic_load(&sv->threads_started), atomic_load(&sv->threads_retired),
+			atomic_load(&sv->service_ns) / 1000, sv->batch_size,
+			total->batches > 0 ? (double)total->batched_requests / total->batches : 0.0);
+	if (sv->snapshot_path != NULL)
+	{
+		fprintf(out, "snapshot %s restored %lu stale %lu\n", sv->snapshot_path, sv->snapshot_restored, sv->snapshot_stale);
+	}
+	fprintf(out, "watch %s invalidations %lu revalidations %lu revalidate %ldms\n",
+			sv->watch != NULL ? "on" : "off", invalidations, total->revalidations,
+			atomic_load(&sv->revalidate_ns) / 1000000);
+	fprintf(out, "negative hits %lu inserts %lu entries %lu ttl %ldms\n",
+			total->negative_hits, total->negative_inserts, negative_count, sv->negative_ttl_ns / 1000000);
+	if (sv->sjf)
+	{
+		fprintf(out, "scheduler sjf max_wait %ldus known %lu guessed %lu\n",
+				sv->sjf_max_wait_ns / 1000, total->sjf_known, total->sjf_guessed);
+	}
+	fprintf(out, "admission %s enqueued %lu rejected %lu expired %lu deadline %ldms\n",
+			sv->shed ? "shed" : "block", total->enqueued, total->rejected, total->expired, sv->deadline_ns / 1000000);
+	if (sv->nr_loops > 0)
+	{
+		fprintf(out, "keepalive max %d idle %ldms reuses %lu pipelined %lu idle_closed %lu\n",
+				sv->keepalive_requests, sv->conn_idle_ns / 1000000, total->keepalive_reuses,
+				total->pipelined, total->idle_closed);
+	}
+	fprintf(out, "cache_lock_waits %lu (%luus) admission_waits %lu (%luus)\n",
+			total->cache_lock_waits, total->cache_lock_wait_ns / 1000,
+			total->admission_waits, total->admission_wait_ns / 1000);
+	histogram_dump(out, "queue_wait", &total->queue_wait);
+	histogram_dump(out, "read", &total->read_time);
+	histogram_dump(out, "send", &total->send_time);
+	fflush(out);
+
+	free(total);
+}
+
+// Dump the stats to stderr every time the process gets SIGUSR1
+void stats_function(struct server *sv)
+{
+	sigset_t stats_signal;
+	int signal;
+
+	sigemptyset(&stats_signal);
+	sigaddset(&stats_signal, SIGUSR1);
+	while (true)
+	{
+		sigwait(&stats_signal, &signal);
+		if (atomic_load(&sv->exiting) == 1)
+		{
+			return;
+		}
+		server_stats_dump(sv, stderr);
+	}
+}
+
+//This hash function takes in a word and returns the full hash
+//Found online here: http://www.cse.yorku.ca/~oz/hash.html
+//The end is mixed (murmur3's finalizer) so every bit of it is usable
+unsigned long hash_string(char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	//printf("Hashing for %s\n", str);
+	while ((c = *str++))
+	{
+		hash = ((hash << 5) + hash) + c;
+		/* hash * 33 + c */
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdul;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ul;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Pick the shard that owns a file, the hash is mixed first (fibonacci hashing)
+// so the shard doesn't line up with the bucket picked inside the shard
+struct wc *cache_shard(struct server *sv, unsigned long hash)
+{
+	return &sv->cache[((hash * 11400714819323198485ul) >> 32) % sv->nr_shards];
+}
+
+// Make an empty index, nr_slots has to be a power of two
+void index_init(struct cache_index *index, unsigned long nr_slots)
+{
+	index->slots = (struct index_slot *)calloc(nr_slots, sizeof(struct index_slot));
+	index->mask = nr_slots - 1;
+	index->count = 0;
+}
+
+// How far a bucket is from where its hash wanted it to be
+static unsigned long
+index_distance(struct cache_index *index, unsigned long hash, unsigned long pos)
+{
+	return (pos - hash) & index->mask;
+}
+
+// Find the bucket holding key, or holding item itself if item isn't NULL
+// Robin hood keeps every run sorted by distance so we can stop as soon
+// as we've gone further than anything in the run
+struct index_slot *index_probe(struct cache_index *index, unsigned long hash, char *key, struct wc_item *item)
+{
+	unsigned long pos = hash & index->mask;
+
+	for (unsigned long distance = 0;; distance++)
+	{
+		struct index_slot *slot = &index->slots[pos];
+
+		if (slot->item == NULL || index_distance(index, slot->hash, pos) < distance)
+		{
+			return NULL;
+		}
+		if (slot->hash == hash && slot->item != INDEX_TOMBSTONE &&
+			(item != NULL ? slot->item == item : strcmp(slot->item->key, key) == 0))
+		{
+			return slot;
+		}
+		pos = (pos + 1) & index->mask;
+	}
+}
+
+// Put an item in, anything closer to home than us has to move along
+void index_place(struct cache_index *index, unsigned long hash, struct wc_item *item)
+{
+	unsigned long pos = hash & index->mask;
+	unsigned long distance = 0;
+
+	index->count++;
+	while (true)
+	{
+		struct index_slot *slot = &index->slots[pos];
+
+		if (slot->item == NULL)
+		{
+			slot->hash = hash;
+			slot->item = item;
+			return;
+		}
+
+		unsigned long slot_distance = index_distance(index, slot->hash, pos);
+		if (slot_distance < distance)
+		{
+			struct index_slot temp = *slot;
+
+			slot->hash = hash;
+			slot->item = item;
+			hash = temp.hash;
+			item = temp.item;
+			distance = slot_distance;
+		}
+		pos = (pos + 1) & index->mask;
+		distance++;
+	}
+}
+
+// Take a bucket out, shifting the rest of its run back one so there
+// are never any holes or tombstones in a live index
+void index_erase(struct cache_index *index, struct index_slot *slot)
+{
+	unsigned long pos = slot - index->slots;
+
+	index->count--;
+	while (true)
+	{
+		unsigned long next = (pos + 1) & index->mask;
+		struct index_slot *next_slot = &index->slots[next];
+
+		if (next_slot->item == NULL || index_distance(index, next_slot->hash, next) == 0)
+		{
+			index->slots[pos].hash = 0;
+			index->slots[pos].item = NULL;
+			return;
+		}
+		index->slots[pos] = *next_slot;
+		pos = next;
+	}
+}
+
+// Move up to steps buckets from the old index into the new one. Moved
+// buckets become tombstones so lookups in the old index still work
+void index_migrate(struct wc *wc, unsigned long steps)
+{
+	while (wc->old_index.slots != NULL && steps-- > 0)
+	{
+		if (wc->migrated > wc->old_index.mask)
+		{
+			wc->tiers[TIER_LARGE].count -= (wc->old_index.mask + 1) * sizeof(struct index_slot);
+			free(wc->old_index.slots);
+			wc->old_index.slots = NULL;
+			wc->old_index.count = 0;
+			return;
+		}
+
+		struct index_slot *slot = &wc->old_index.slots[wc->migrated++];
+		if (slot->item != NULL && slot->item != INDEX_TOMBSTONE)
+		{
+			index_place(&wc->index, slot->hash, slot->item);
+			slot->item = INDEX_TOMBSTONE;
+			wc->old_index.count--;
+		}
+	}
+}
+
+// Double the index when it's 7/8 full, the current one becomes the old
+// one and gets moved over bit by bit
+static void
+index_grow(struct wc *wc)
+{
+	unsigned long nr_slots = wc->index.mask + 1;
+
+	if ((unsigned long)(wc->index.count + wc->old_index.count + 1) * 8 <= nr_slots * 7)
+	{
+		return;
+	}
+
+	// Only one move at a time
+	index_migrate(wc, ULONG_MAX);
+
+	wc->old_index = wc->index;
+	wc->migrated = 0;
+	index_init(&wc->index, nr_slots * 2);
+	wc->tiers[TIER_LARGE].count += nr_slots * 2 * sizeof(struct index_slot);
+}
+
+// Size of the objects in a slab class
+static size_t
+slab_class_size(int size_class)
+{
+	if (size_class % 2 == 0)
+	{
+		return SLAB_MIN_OBJECT << (size_class / 2);
+	}
+	return (SLAB_MIN_OBJECT << (size_class / 2)) * 3 / 2;
+}
+
+// Smallest slab class that fits size
+static int
+slab_class_of(size_t size)
+{
+	int size_class = 0;
+
+	while (slab_class_size(size_class) < size)
+	{
+		size_class++;
+	}
+	return size_class;
+}
+
+// Where the first object of a slab starts, after the header
+static size_t
+slab_header_size(void)
+{
+	return (sizeof(struct slab) + 63) & ~63ul;
+}
+
+static size_t
+page_round(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (size + page - 1) & ~(page - 1);
+}
+
+// Bytes mapped for an extent class, the first one is just above SLAB_MAX_OBJECT
+static size_t
+extent_class_size(int extent_class)
+{
+	int i = extent_class + 1;
+
+	if (i % 2 == 0)
+	{
+		return page_round(SLAB_MAX_OBJECT << (i / 2));
+	}
+	return page_round((SLAB_MAX_OBJECT << (i / 2)) * 3 / 2);
+}
+
+// Smallest extent class that fits size, -1 for ones too big to pool
+static int
+extent_class_of(size_t size)
+{
+	if (size > EXTENT_MAX_OBJECT)
+	{
+		return -1;
+	}
+
+	int extent_class = 0;
+	while (extent_class_size(extent_class) < size)
+	{
+		extent_class++;
+	}
+	return extent_class;
+}
+
+// What a large object really maps
+static size_t
+extent_size(size_t size)
+{
+	int extent_class = extent_class_of(size);
+
+	return extent_class >= 0 ? extent_class_size(extent_class) : page_round(size);
+}
+
+// Map a SLAB_SIZE aligned slab by mapping twice as much and
+// giving back the ends
+static void *
+slab_map(void)
+{
+	char *map = mmap(NULL, SLAB_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	char *slab = (char *)(((uintptr_t)map + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1));
+	if (slab > map)
+	{
+		munmap(map, slab - map);
+	}
+	munmap(slab + SLAB_SIZE, map + SLAB_SIZE - slab);
+	return slab;
+}
+
+static void
+slab_list_remove(struct slab_class *class, struct slab *slab)
+{
+	if (slab->prev != NULL)
+	{
+		slab->prev->next = slab->next;
+	}
+	else
+	{
+		class->partial = slab->next;
+	}
+	if (slab->next != NULL)
+	{
+		slab->next->prev = slab->prev;
+	}
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+static void
+slab_list_push(struct slab_class *class, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = class->partial;
+	if (class->partial != NULL)
+	{
+		class->partial->prev = slab;
+	}
+	class->partial = slab;
+}
+
+void arena_init(struct cache_arena *arena)
+{
+	pthread_mutex_init(&arena->lock, NULL);
+	for (int i = 0; i < SLAB_CLASSES; i++)
+	{
+		arena->classes[i].object_size = slab_class_size(i);
+		arena->classes[i].partial = NULL;
+	}
+	for (int i = 0; i < EXTENT_CLASSES; i++)
+	{
+		arena->extents[i] = NULL;
+	}
+	arena->slab_bytes = 0;
+	arena->large_bytes = 0;
+	arena->pooled_bytes = 0;
+	arena->node = -1;
+}
+
+// Have the pages of a new mapping come from the arena's node when they're
+// first touched, whichever thread that is. Only a preference so a full
+// node still hands out memory from another one
+static void
+arena_place(struct cache_arena *arena, void *map, size_t size)
+{
+	unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+
+	if (arena->node < 0)
+	{
+		return;
+	}
+	mask[arena->node / (8 * sizeof(unsigned long))] = 1ul << (arena->node % (8 * sizeof(unsigned long)));
+	syscall(__NR_mbind, map, size, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1, 0);
+}
+
+// Everything should have been freed by now, so only empty
+// slabs and pooled extents kept around for reuse are left
+void arena_destroy(struct cache_arena *arena)
+{
+	for (int i = 0; i < SLAB_CLASSES; i++)
+	{
+		while (arena->classes[i].partial != NULL)
+		{
+			struct slab *slab = arena->classes[i].partial;
+
+			slab_list_remove(&arena->classes[i], slab);
+			munmap(slab, SLAB_SIZE);
+		}
+	}
+	for (int i = 0; i < EXTENT_CLASSES; i++)
+	{
+		while (arena->extents[i] != NULL)
+		{
+			void *extent = arena->extents[i];
+
+			arena->extents[i] = *(void **)extent;
+			munmap(extent, extent_class_size(i));
+		}
+	}
+	pthread_mutex_destroy(&arena->lock);
+}
+
+// Bytes an allocation of size really takes up
+long arena_charge(size_t size)
+{
+	if (size > SLAB_MAX_OBJECT)
+	{
+		return extent_size(size);
+	}
+	return slab_class_size(slab_class_of(size));
+}
+
+// Get size bytes, NULL if the system is out of memory
+void *arena_alloc(struct cache_arena *arena, size_t size)
+{
+	void *ptr;
+
+	// Big buffers are mapped on their own, or taken from the
+	// pool when one of the same class was freed earlier
+	if (size > SLAB_MAX_OBJECT)
+	{
+		int extent_class = extent_class_of(size);
+		size_t mapped = extent_size(size);
+
+		if (extent_class >= 0)
+		{
+			pthread_mutex_lock(&arena->lock);
+			ptr = arena->extents[extent_class];
+			if (ptr != NULL)
+			{
+				arena->extents[extent_class] = *(void **)ptr;
+				arena->pooled_bytes -= mapped;
+				pthread_mutex_unlock(&arena->lock);
+				return ptr;
+			}
+			pthread_mutex_unlock(&arena->lock);
+		}
+
+		ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+		{
+			return NULL;
+		}
+		arena_place(arena, ptr, mapped);
+		pthread_mutex_lock(&arena->lock);
+		arena->large_bytes += mapped;
+		pthread_mutex_unlock(&arena->lock);
+		return ptr;
+	}
+
+	int size_class = slab_class_of(size);
+	struct slab_class *class = &arena->classes[size_class];
+
+	pthread_mutex_lock(&arena->lock);
+	struct slab *slab = class->partial;
+	if (slab == NULL)
+	{
+		slab = slab_map();
+		if (slab == NULL)
+		{
+			pthread_mutex_unlock(&arena->lock);
+			return NULL;
+		}
+		arena_place(arena, slab, SLAB_SIZE);
+		slab->prev = NULL;
+		slab->next = NULL;
+		slab->free_list = NULL;
+		slab->unused = (char *)slab + slab_header_size();
+		slab->in_use = 0;
+		slab->nr_objects = (SLAB_SIZE - slab_header_size()) / class->object_size;
+		slab->size_class = size_class;
+		slab_list_push(class, slab);
+		arena->slab_bytes += SLAB_SIZE;
+	}
+
+	// Reuse a freed object first, otherwise take one that's never been used
+	if (slab->free_list != NULL)
+	{
+		ptr = slab->free_list;
+		slab->free_list = *(void **)ptr;
+	}
+	else
+	{
+		ptr = slab->unused;
+		slab->unused += class->object_size;
+	}
+
+	// Full slabs aren't on any list until something in them is freed
+	if (++slab->in_use == slab->nr_objects)
+	{
+		slab_list_remove(class, slab);
+	}
+	pthread_mutex_unlock(&arena->lock);
+	return ptr;
+}
+
+// Give back something from arena_alloc, size has to be what was asked for
+void arena_free(struct cache_arena *arena, void *ptr, size_t size)
+{
+	if (size > SLAB_MAX_OBJECT)
+	{
+		int extent_class = extent_class_of(size);
+		size_t mapped = extent_size(size);
+
+		// Keep it for the next buffer this size while the pool has room
+		pthread_mutex_lock(&arena->lock);
+		if (extent_class >= 0 && arena->pooled_bytes + (long)mapped <= ARENA_POOL_BYTES)
+		{
+			*(void **)ptr = arena->extents[extent_class];
+			arena->extents[extent_class] = ptr;
+			arena->pooled_bytes += mapped;
+			pthread_mutex_unlock(&arena->lock);
+			return;
+		}
+		arena->large_bytes -= mapped;
+		pthread_mutex_unlock(&arena->lock);
+		munmap(ptr, mapped);
+		return;
+	}
+
+	struct slab *slab = (struct slab *)((uintptr_t)ptr & ~(SLAB_SIZE - 1));
+	struct slab_class *class = &arena->classes[slab->size_class];
+
+	pthread_mutex_lock(&arena->lock);
+	*(void **)ptr = slab->free_list;
+	slab->free_list = ptr;
+	if (slab->in_use-- == slab->nr_objects)
+	{
+		slab_list_push(class, slab);
+	}
+
+	// Empty slabs go back to the system, except the last one
+	// with room so a class doesn't keep mapping and unmapping
+	if (slab->in_use == 0 && (slab->prev != NULL || slab->next != NULL))
+	{
+		slab_list_remove(class, slab);
+		munmap(slab, SLAB_SIZE);
+		arena->slab_bytes -= SLAB_SIZE;
+	}
+	pthread_mutex_unlock(&arena->lock);
+}
+
+// Bytes of an item with a key this long
+static size_t
+wc_item_size(const char *key)
+{
+	return sizeof(struct wc_item) + strlen(key) + 1;
+}
+
+// Bytes of a small file's item with its header and the file after the key,
+// in whole cache lines so every one starts on its own. The item alone is
+// about four of them (the policy fields and the condition variable are most
+// of it), so inlining saves the second allocation and pointer chase, not
+// lines: a hit on a 100 byte file still touches half a dozen
+static size_t
+wc_item_inline_size(const char *key, int header_len, long file_size)
+{
+	return (wc_item_size(key) + header_len + file_size + 63) & ~63ul;
+}
+
+// Everything but the references and loading state of a new item
+static void
+wc_item_init(struct wc *wc, struct wc_item *item, const char *key, unsigned long hash)
+{
+	strcpy(item->key, key);
+	item->data = NULL;
+	item->arena = &wc->arena;
+	item->tier = NULL;
+	item->inlined = false;
+	item->moved = NULL;
+	item->header = NULL;
+	item->header_len = 0;
+	item->lru_prev = NULL;
+	item->lru_next = NULL;
+	item->failed = false;
+	item->hash = hash;
+	item->referenced = false;
+	item->frequency = 1;
+	item->priority = 0;
+	item->heap_index = -1;
+	item->dev = 0;
+	item->ino = 0;
+	item->checked = 0;
+	item->changed = false;
+	pthread_cond_init(&item->loaded, NULL);
+	item->parked = NULL;
+}
+
+//This function DESTROYS (!) a wc_item
+void wc_item_destroy(struct wc_item *item)
+{
+	// Want to make sure, a small file goes with its item
+	if (item->moved != NULL)
+	{
+		cache_release(item->moved);
+	}
+	else if (!item->inlined)
+	{
+		if (item->data != NULL)
+		{
+			arena_free(item->arena, item->data->file_buf, item->data->file_size);
+		}
+		if (item->header != NULL)
+		{
+			arena_free(item->arena, item->header, item->header_len);
+		}
+	}
+	pthread_cond_destroy(&item->loaded);
+	arena_free(item->arena, item, item->inlined ? wc_item_inline_size(item->key, item->header_len, item->file.file_size)
+												: wc_item_size(item->key));
+	return;
+}
+
+// Find a file in the index without touching the lru
+struct wc_item *cache_find(struct wc *wc, char *file_name, unsigned long hash)
+{
+	struct index_slot *slot = index_probe(&wc->index, hash, file_name, NULL);
+
+	// It might not have been moved out of the old index yet
+	if (slot == NULL && wc->old_index.slots != NULL)
+	{
+		slot = index_probe(&wc->old_index, hash, file_name, NULL);
+	}
+
+	return slot != NULL ? slot->item : NULL;
+}
+
+// Look up a file in the cache, the shard lock must be held
+struct wc_item *cache_lookup(struct wc *wc, char *file_name, unsigned long hash)
+{
+	if (wc->policy->access != NULL)
+	{
+		wc->policy->access(wc, hash);
+	}
+
+	struct wc_item *iterator = cache_find(wc, file_name, hash);
+	if (iterator != NULL)
+	{
+		//printf("Found file in cache! Key: %s, File: %s\n", iterator->key, file_name);
+
+		// Let the replacement policy know, files still loading aren't in it yet
+		if (!iterator->loading)
+		{
+			wc->policy->hit(wc, iterator);
+		}
+		return iterator;
+	}
+	else
+	{
+		//printf("Not found in cache!\n");
+		return NULL;
+	}
+}
+
+// Put a placeholder for a file that's about to be read into the shard so
+// anyone else who misses on it waits instead of reading it too. The caller
+// holds a reference and has to either cache_add or cache_abandon it
+struct wc_item *cache_reserve(struct wc *wc, char *file_name, unsigned long hash)
+{
+	struct wc_item *new_file = arena_alloc(&wc->arena, wc_item_size(file_name));
+	if (new_file == NULL)
+	{
+		return NULL;
+	}
+	wc_item_init(wc, new_file, file_name, hash);
+	new_file->charge = arena_charge(wc_item_size(file_name));
+	// One reference for the cache and one for the caller
+	atomic_init(&new_file->refcount, 2);
+	new_file->loading = true;
+
+	//printf("Insertion: %s\n", new_file->key);
+	index_migrate(wc, INDEX_MIGRATE_STEP);
+	index_grow(wc);
+	index_place(&wc->index, hash, new_file);
+
+	return new_file;
+}
+
+// Which tier a file this big goes in
+struct cache_tier *cache_tier_for(struct wc *wc, long file_size)
+{
+	return &wc->tiers[file_size <= wc->small_max ? TIER_SMALL : TIER_LARGE];
+}
+
+// A copy of a small file's placeholder with the file stored right after the key
+static struct wc_item *
+wc_item_inline(struct wc *wc, struct wc_item *placeholder, struct file_data *data)
+{
+	char header[RESPONSE_HEADER_MAX];
+	int header_len = response_header_start(header, sizeof(header), placeholder->key, data->file_size);
+	size_t size = wc_item_inline_size(placeholder->key, header_len, data->file_size);
+	struct wc_item *item = arena_alloc(&wc->arena, size);
+	if (item == NULL)
+	{
+		return NULL;
+	}
+
+	wc_item_init(wc, item, placeholder->key, placeholder->hash);
+	item->inlined = true;
+	item->charge = arena_charge(size);
+	item->header = item->key + strlen(item->key) + 1;
+	item->header_len = header_len;
+	memcpy(item->header, header, header_len);
+	item->file.file_name = item->key;
+	item->file.file_buf = item->header + header_len;
+	item->file.file_size = data->file_size;
+	memcpy(item->file.file_buf, data->file_buf, data->file_size);
+	item->data = &item->file;
+	item->mtime = placeholder->mtime;
+	item->dev = placeholder->dev;
+	item->ino = placeholder->ino;
+	item->checked = placeholder->checked;
+	item->changed = placeholder->changed;
+	// Only the cache's reference, the caller keeps holding the placeholder
+	atomic_init(&item->refcount, 1);
+	item->loading = false;
+	return item;
+}
+
+// Put new_item where old_item is in the index
+/* the item is done loading one way or another, wake the threads waiting for it
+ * and send the parked connections back to their loops to look it up again */
+static void
+cache_loaded(struct wc_item *item)
+{
+	pthread_cond_broadcast(&item->loaded);
+	while (item->parked != NULL)
+	{
+		struct connection *conn = item->parked;
+
+		item->parked = conn->next;
+		event_loop_push(conn->loop, &conn->loop->finished, conn);
+	}
+}
+
+static void
+cache_replace(struct wc *wc, struct wc_item *old_item, struct wc_item *new_item)
+{
+	struct index_slot *slot = index_probe(&wc->index, old_item->hash, NULL, old_item);
+
+	if (slot == NULL)
+	{
+		slot = index_probe(&wc->old_index, old_item->hash, NULL, old_item);
+	}
+	slot->item = new_item;
+}
+
+// Fill in a reserved file now that it's been read, the shard lock must be held
+// data->file_buf has to come from the shard's arena. Returns 1 if the file is
+// now cached (and the cache owns the buffer) or -1 if it can't be cached, in
+// which case the placeholder is abandoned. A small file is copied into a new
+// item that takes the placeholder's place, anyone holding the placeholder
+// sees the new item's data
+int cache_add(struct wc *wc, struct wc_item *new_file, struct file_data *data)
+{
+	struct cache_tier *tier = cache_tier_for(wc, data->file_size);
+	struct wc_item *placeholder = NULL;
+
+	if (tier == &wc->tiers[TIER_SMALL])
+	{
+		placeholder = new_file;
+		new_file = wc_item_inline(wc, placeholder, data);
+		if (new_file == NULL)
+		{
+			cache_abandon(wc, placeholder);
+			return -1;
+		}
+	}
+	else
+	{
+		char header[RESPONSE_HEADER_MAX];
+		int header_len = response_header_start(header, sizeof(header), new_file->key, data->file_size);
+
+		new_file->header = arena_alloc(&wc->arena, header_len);
+		if (new_file->header == NULL)
+		{
+			cache_abandon(wc, new_file);
+			return -1;
+		}
+		memcpy(new_file->header, header, header_len);
+		new_file->header_len = header_len;
+		new_file->charge += arena_charge(header_len);
+		new_file->file.file_name = new_file->key;
+		new_file->file.file_buf = data->file_buf;
+		new_file->file.file_size = data->file_size;
+		new_file->data = &new_file->file;
+		new_file->charge += arena_charge(data->file_size);
+	}
+	new_file->tier = tier;
+
+	// Make sure that the tier has enough space
+	// if it does not then evict a file...
+	if (tier->count + new_file->charge > tier->size && cache_evict(wc, tier, new_file) != 1)
+	{
+		if (placeholder != NULL)
+		{
+			wc_item_destroy(new_file);
+			new_file = placeholder;
+		}
+		new_file->data = NULL;
+		cache_abandon(wc, new_file);
+		return -1;
+	}
+
+	// The small copy goes in the index instead, and the cache's reference
+	// to the placeholder goes. The buffer it was read into isn't needed
+	if (placeholder != NULL)
+	{
+		cache_replace(wc, placeholder, new_file);
+		atomic_fetch_add_explicit(&new_file->refcount, 1, memory_order_relaxed);
+		placeholder->moved = new_file;
+		placeholder->data = new_file->data;
+		placeholder->header = new_file->header;
+		placeholder->header_len = new_file->header_len;
+		placeholder->loading = false;
+		cache_loaded(placeholder);
+		cache_release(placeholder);
+		arena_free(&wc->arena, data->file_buf, data->file_size);
+	}
+
+	// Hand it to the replacement policy...
+	tier->count += new_file->charge;
+	wc->policy->insert(wc, new_file);
+
+	// ...and everyone who was waiting for it
+	new_file->loading = false;
+	cache_loaded(new_file);
+	return 1;
+}
+
+// Give up on a reserved file, waiters are told to read it themselves
+// and both the cache's and our reference are dropped
+void cache_abandon(struct wc *wc, struct wc_item *item)
+{
+	cache_unlink(wc, item);
+	item->loading = false;
+	item->failed = true;
+	cache_loaded(item);
+	cache_release(item);
+	cache_release(item);
+}
+
+// Drop a reference, the last one out frees the item. This doesn't need
+// the shard lock since nobody can find the item once it's been unlinked
+void cache_release(struct wc_item *item)
+{
+	if (atomic_fetch_sub_explicit(&item->refcount, 1, memory_order_acq_rel) == 1)
+	{
+		//printf("Freeing %s\n", item->key);
+		wc_item_destroy(item);
+	}
+}
+
+//Evict items from the tier until new_file fits
+int cache_evict(struct wc *wc, struct cache_tier *tier, struct wc_item *new_file)
+{
+	//Find the least recently used file and evict it
+	//Files that are still being sent go right away too, the
+	//last sender frees them
+	if (new_file->charge > tier->size)
+	{
+		//printf("File too big\n");
+		return -1;
+	}
+
+	// Remove the file the policy picks, and update the current size of the tier
+	// If there isn't enough space then DO IT AGAIN!
+	while (tier->count + new_file->charge > tier->size)
+	{
+		// Get the victim
+		struct wc_item *to_be_evicted = wc->policy->victim(wc, tier);
+		if (to_be_evicted == NULL)
+		{
+			//printf("Failed to_evicted != NULL\n");
+			return -1;
+		}
+
+		// Admission policies can decide the new file isn't worth it
+		if (wc->policy->admit != NULL && !wc->policy->admit(wc, new_file, to_be_evicted))
+		{
+			return -1;
+		}
+
+		// Otherwise delete that file and check if another needs to be deleted...
+		tier->evictions++;
+		wc->policy->remove(wc, to_be_evicted);
+		cache_delete(wc, to_be_evicted);
+	}
+
+	return 1;
+}
+
+// Take an item out of the index
+void cache_unlink(struct wc *wc, struct wc_item *item)
+{
+	struct index_slot *slot = index_probe(&wc->index, item->hash, NULL, item);
+
+	if (slot != NULL)
+	{
+		index_erase(&wc->index, slot);
+	}
+	// Still in the old index, just leave a tombstone there
+	else
+	{
+		slot = index_probe(&wc->old_index, item->hash, NULL, item);
+		slot->item = INDEX_TOMBSTONE;
+		wc->old_index.count--;
+	}
+	index_migrate(wc, INDEX_MIGRATE_STEP);
+}
+
+// Delete a file from the shard, the policy must already have let go of it
+// Its bytes stop counting right away, the memory goes when the last
+// thread still sending it is done
+void cache_delete(struct wc *wc, struct wc_item *to_be_deleted)
+{
+	//printf("Deleting file!\n");
+	cache_unlink(wc, to_be_deleted);
+	to_be_deleted->tier->count -= to_be_deleted->charge;
+
+	// Now drop the cache's reference to to_be_deleted...
+	cache_release(to_be_deleted);
+	return;
+}
+
+// Remember which file on disk an item was read from
+void cache_identify(struct wc_item *item, const struct stat *st)
+{
+	item->mtime = st->st_mtim;
+	item->dev = st->st_dev;
+	item->ino = st->st_ino;
+	item->checked = now_ns();
+}
+
+// Is it time to compare a cached file with the one on disk? The shard lock
+// must be held, only one thread is told yes until it's due again
+bool cache_check_due(struct server *sv, struct wc_item *item)
+{
+	long revalidate_ns = atomic_load_explicit(&sv->revalidate_ns, memory_order_relaxed);
+	bool due = item->changed || item->checked < atomic_load_explicit(&sv->revalidate_before, memory_order_relaxed);
+
+	if (!due && revalidate_ns > 0)
+	{
+		due = now_ns() - item->checked >= revalidate_ns;
+	}
+	if (due)
+	{
+		item->changed = false;
+		item->checked = now_ns();
+	}
+	return due;
+}
+
+// Is the file on disk not the one that was cached any more, no lock needed
+bool cache_file_changed(struct wc_item *item)
+{
+	struct stat st;
+
+	return stat(item->key, &st) < 0 || st.st_dev != item->dev || st.st_ino != item->ino ||
+		   st.st_size != item->data->file_size || st.st_mtim.tv_sec != item->mtime.tv_sec ||
+		   st.st_mtim.tv_nsec != item->mtime.tv_nsec;
+}
+
+// Drop a file that changed on disk so the next request reads it again, the
+// shard lock must be held. One that's still being read in is only marked,
+// it gets compared with the disk on its first hit
+bool cache_invalidate(struct wc *wc, struct wc_item *item)
+{
+	if (item->loading)
+	{
+		item->changed = true;
+		return false;
+	}
+
+	// Someone else could have dropped it already
+	if (cache_find(wc, item->key, item->hash) != item)
+	{
+		return false;
+	}
+
+	wc->invalidations++;
+	wc->policy->remove(wc, item);
+	cache_delete(wc, item);
+	return true;
+}
+
+// Was the file missing when it was last asked for, not too long ago?
+// The shard lock must be held
+bool negative_find(struct wc *wc, char *file_name, unsigned long hash)
+{
+	if (wc->negative == NULL)
+	{
+		return false;
+	}
+
+	struct negative_entry *entry = &wc->negative[hash & wc->negative_mask];
+	if (entry->key == NULL || entry->hash != hash || strcmp(entry->key, file_name) != 0)
+	{
+		return false;
+	}
+	if (entry->expires <= now_ns())
+	{
+		negative_forget(wc, file_name, hash);
+		return false;
+	}
+	return true;
+}
+
+// Remember that a file is missing, pushing out whatever had its slot
+// The shard lock must be held
+void negative_add(struct wc *wc, char *file_name, unsigned long hash, long ttl_ns)
+{
+	struct negative_entry *entry = &wc->negative[hash & wc->negative_mask];
+
+	if (entry->key == NULL)
+	{
+		wc->negative_count++;
+	}
+	else if (entry->hash != hash || strcmp(entry->key, file_name) != 0)
+	{
+		free(entry->key);
+		entry->key = NULL;
+	}
+	if (entry->key == NULL)
+	{
+		entry->key = strdup(file_name);
+	}
+	entry->hash = hash;
+	entry->expires = now_ns() + ttl_ns;
+}
+
+// The file showed up, stop saying it's missing. The shard lock must be held
+void negative_forget(struct wc *wc, char *file_name, unsigned long hash)
+{
+	if (wc->negative == NULL)
+	{
+		return;
+	}
+
+	struct negative_entry *entry = &wc->negative[hash & wc->negative_mask];
+	if (entry->key != NULL && entry->hash == hash && strcmp(entry->key, file_name) == 0)
+	{
+		free(entry->key);
+		entry->key = NULL;
+		wc->negative_count--;
+	}
+}
+
+// Start the inotify watcher, NULL if there's no inotify
+struct cache_watch *cache_watch_start(struct server *sv)
+{
+	struct cache_watch *watch = (struct cache_watch *)malloc(sizeof(struct cache_watch));
+
+	watch->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	watch->wakefd = eventfd(0, EFD_CLOEXEC);
+	if (watch->fd < 0 || watch->wakefd < 0)
+	{
+		if (watch->fd >= 0)
+		{
+			close(watch->fd);
+		}
+		if (watch->wakefd >= 0)
+		{
+			close(watch->wakefd);
+		}
+		free(watch);
+		return NULL;
+	}
+
+	pthread_mutex_init(&watch->lock, NULL);
+	watch->dirs = NULL;
+	watch->nr_dirs = 0;
+	for (int i = 0; i < CACHE_WATCH_KNOWN; i++)
+	{
+		atomic_init(&watch->known[i], 0);
+	}
+	atomic_init(&watch->generation, 0);
+	sv->watch = watch;
+	pthread_create(&watch->thread, NULL, (void *)&cache_watch_function, sv);
+	return watch;
+}
+
+// Stop the watcher and forget every directory
+void cache_watch_stop(struct cache_watch *watch)
+{
+	eventfd_write(watch->wakefd, 1);
+	pthread_join(watch->thread, NULL);
+
+	for (int i = 0; i < watch->nr_dirs; i++)
+	{
+		while (watch->dirs[i] != NULL)
+		{
+			struct watch_prefix *prefix = watch->dirs[i];
+			watch->dirs[i] = prefix->next;
+			free(prefix);
+		}
+	}
+	free(watch->dirs);
+	close(watch->fd);
+	close(watch->wakefd);
+	pthread_mutex_destroy(&watch->lock);
+	free(watch);
+}
+
+// Start watching the directory a file about to be cached is in, if it isn't
+// watched already. Must not be called with a shard lock held
+void cache_watch_add(struct server *sv, const char *key)
+{
+	struct cache_watch *watch = sv->watch;
+	const char *slash = strrchr(key, '/');
+	size_t prefix_len = slash != NULL ? (size_t)(slash - key) + 1 : 0;
+	char dir[PATH_MAX];
+
+	if (watch == NULL || prefix_len >= sizeof(dir))
+	{
+		return;
+	}
+	memcpy(dir, key, prefix_len);
+	dir[prefix_len] = '\0';
+
+	// Almost every miss is in a directory we're already watching
+	unsigned long hash = hash_string(dir) | 1;
+	unsigned long slot = hash % CACHE_WATCH_KNOWN;
+	for (int i = 0; i < CACHE_WATCH_KNOWN; i++)
+	{
+		unsigned long seen = atomic_load_explicit(&watch->known[(slot + i) % CACHE_WATCH_KNOWN], memory_order_relaxed);
+		if (seen == hash)
+		{
+			return;
+		}
+		if (seen == 0)
+		{
+			break;
+		}
+	}
+
+	// If a watch goes away while we add ours it might be this one, then
+	// it mustn't be remembered as watched
+	long generation = atomic_load(&watch->generation);
+
+	// The same directory always gets the same descriptor back
+	int wd = inotify_add_watch(watch->fd, prefix_len > 0 ? dir : ".", CACHE_WATCH_EVENTS);
+	if (wd < 0)
+	{
+		// Out of watches, changes in this directory can only be
+		// found by looking so start doing that if we weren't
+		if (errno == ENOSPC)
+		{
+			long off = 0;
+			atomic_compare_exchange_strong(&sv->revalidate_ns, &off, CACHE_REVALIDATE_MS * 1000000l);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&watch->lock);
+	if (wd >= watch->nr_dirs)
+	{
+		int nr_dirs = watch->nr_dirs > 0 ? watch->nr_dirs : 16;
+		while (nr_dirs <= wd)
+		{
+			nr_dirs *= 2;
+		}
+		watch->dirs = (struct watch_prefix **)realloc(watch->dirs, sizeof(struct watch_prefix *) * nr_dirs);
+		memset(watch->dirs + watch->nr_dirs, 0, sizeof(struct watch_prefix *) * (nr_dirs - watch->nr_dirs));
+		watch->nr_dirs = nr_dirs;
+	}
+
+	struct watch_prefix *prefix = watch->dirs[wd];
+	while (prefix != NULL && strcmp(prefix->prefix, dir) != 0)
+	{
+		prefix = prefix->next;
+	}
+	if (prefix == NULL)
+	{
+		prefix = (struct watch_prefix *)malloc(sizeof(struct watch_prefix) + prefix_len + 1);
+		strcpy(prefix->prefix, dir);
+		prefix->next = watch->dirs[wd];
+		watch->dirs[wd] = prefix;
+	}
+	if (atomic_load(&watch->generation) == generation)
+	{
+		// Full means the next miss here pays for the syscall again
+		for (int i = 0; i < CACHE_WATCH_KNOWN; i++)
+		{
+			_Atomic unsigned long *known = &watch->known[(slot + i) % CACHE_WATCH_KNOWN];
+			unsigned long seen = atomic_load_explicit(known, memory_order_relaxed);
+			if (seen == hash)
+			{
+				break;
+			}
+			if (seen == 0)
+			{
+				atomic_store_explicit(known, hash, memory_order_relaxed);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&watch->lock);
+}
+
+// Drop whatever a single inotify event says changed
+static void
+cache_watch_event(struct server *sv, struct cache_watch *watch, struct inotify_event *event)
+{
+	// Events were lost, so anything could have changed
+	if (event->mask & IN_Q_OVERFLOW)
+	{
+		atomic_store(&sv->revalidate_before, now_ns());
+		return;
+	}
+
+	pthread_mutex_lock(&watch->lock);
+	if (event->wd < 0 || event->wd >= watch->nr_dirs)
+	{
+		pthread_mutex_unlock(&watch->lock);
+		return;
+	}
+
+	// The watch is gone, it's added again the next time a file there is cached
+	if (event->mask & IN_IGNORED)
+	{
+		// Can't tell which hash was this directory's, so forget them all
+		atomic_fetch_add(&watch->generation, 1);
+		for (int i = 0; i < CACHE_WATCH_KNOWN; i++)
+		{
+			atomic_store_explicit(&watch->known[i], 0, memory_order_relaxed);
+		}
+		while (watch->dirs[event->wd] != NULL)
+		{
+			struct watch_prefix *prefix = watch->dirs[event->wd];
+			watch->dirs[event->wd] = prefix->next;
+			free(prefix);
+		}
+	}
+	// The directory itself moved or went away, every file in it
+	// is looked at on its next hit instead of being hunted down now
+	else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+	{
+		atomic_store(&sv->revalidate_before, now_ns());
+	}
+	else if (event->len > 0)
+	{
+		for (struct watch_prefix *prefix = watch->dirs[event->wd]; prefix != NULL; prefix = prefix->next)
+		{
+			char path[PATH_MAX];
+
+			if (snprintf(path, sizeof(path), "%s%s", prefix->prefix, event->name) >= (int)sizeof(path))
+			{
+				continue;
+			}
+
+			// Not shard_lock, this thread has no counters of its own
+			unsigned long hash = hash_string(path);
+			struct wc *shard = cache_shard(sv, hash);
+			pthread_mutex_lock(&shard->lock);
+			struct wc_item *item = cache_find(shard, path, hash);
+			if (item != NULL)
+			{
+				cache_invalidate(shard, item);
+			}
+			negative_forget(shard, path, hash);
+			pthread_mutex_unlock(&shard->lock);
+		}
+	}
+	pthread_mutex_unlock(&watch->lock);
+}
+
+// The watcher thread, waits for inotify events until cache_watch_stop
+void cache_watch_function(struct server *sv)
+{
+	struct cache_watch *watch = sv->watch;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = {{watch->fd, POLLIN, 0}, {watch->wakefd, POLLIN, 0}};
+
+	while (true)
+	{
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+		{
+			return;
+		}
+		if (fds[1].revents != 0)
+		{
+			return;
+		}
+
+		ssize_t len = read(watch->fd, buf, sizeof(buf));
+		for (char *next = buf; len > 0 && next < buf + len;)
+		{
+			struct inotify_event *event = (struct inotify_event *)next;
+			cache_watch_event(sv, watch, event);
+			next += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
+// Rearrange the lru to keep track of which file is the most recently used
+// HEAD <-> [KeyM] <-> [Key1] <-> [Key2] <-> ... [KeyN] <- TAIL
+// Everything here is constant time, no walking the list
+void maintain_lru(struct head_of_lru *lru_queue, struct wc_item *lru, bool new_file)
+{
+	// Check if lru is at the front of the list...
+	if (lru_queue->head == lru)
+	{
+		//Do nothing
+		return;
+	}
+
+	// Take lru out of the list if it's already in there
+	if (!new_file)
+	{
+		lru_remove(lru_queue, lru);
+	}
+
+	// Push it onto the front
+	lru->lru_prev = NULL;
+	lru->lru_next = lru_queue->head;
+	if (lru_queue->head != NULL)
+	{
+		lru_queue->head->lru_prev = lru;
+	}
+	else
+	{
+		lru_queue->tail = lru;
+	}
+	lru_queue->head = lru;
+	return;
+}
+
+// Unlink an item from the lru
+void lru_remove(struct head_of_lru *lru_queue, struct wc_item *lru)
+{
+	if (lru->lru_prev != NULL)
+	{
+		lru->lru_prev->lru_next = lru->lru_next;
+	}
+	else
+	{
+		lru_queue->head = lru->lru_next;
+	}
 
-	if (sv->nr_threads == 0)
-	{ /* no worker threads */
-		do_server_request(sv, connfd);
+	if (lru->lru_next != NULL)
+	{
+		lru->lru_next->lru_prev = lru->lru_prev;
 	}
 	else
 	{
-		/*  Save the relevant info in a buffer and have one of the
-		 *  worker threads do the work. */
-
-		// Update the buffer and update, also lock now
-		// because this stuff is global ya feel?
-		pthread_mutex_lock(sv->mutex_lock);
-		// //printf("Obtained lock in server_request\n");
+		lru_queue->tail = lru->lru_prev;
+	}
 
-		// Wait for a signal while the buffer is full
-		// This signal comes from the worker thread stub function
-		// [Request1 | Request2 | Request3 ... | RequestMax]
-		//		^								      ^
-		//		|									  |
-		//	   out									  in
-		while ((sv->in - sv->out + sv->max_requests) % sv->max_requests == sv->max_requests - 1 && sv->exiting != 1)
-		{
-			// Waiting on signal from stub_function
-			// //printf("In server_request waiting for sv->full\n");
-			pthread_cond_wait(sv->full, sv->mutex_lock);
-		}
-		// //printf("Not waiting on sv->full\n");
+	lru->lru_prev = NULL;
+	lru->lru_next = NULL;
+}
 
-		// Update the buffer with connfd
-		// So now a worker thread will read this value and then do the request
-		sv->buffer[sv->in] = connfd;
+// The least recently used file is at the end of the lru
+struct wc_item *least_recently_used_file(struct head_of_lru *lru_queue)
+{
+	return lru_queue->tail;
+}
 
-		// Unblock threads waiting on sv->empty
-		// Tell the threads waiting on the buffer to be NOT empty that there is a request availible
-		if ((sv->in - sv->out + sv->max_requests) % sv->max_requests == 0)
-		{
-			// //printf("Sending signal sv->empty\n");
-			pthread_cond_broadcast(sv->empty);
-		}
+// ~~~ Replacement policies ~~~
 
-		// Increment the in pointer, recall the buffer is circular
-		sv->in = (sv->in + 1) % sv->max_requests;
-		// //printf("In: %d\n", sv->in);
+// lru: hits move to the front, evict from the back
+static void
+lru_insert(struct wc *wc, struct wc_item *item)
+{
+	(void)wc;
+	maintain_lru(item->tier->lru_queue, item, true);
+}
 
-		// //printf("Releasing lock in request_server\n");
-		// Release the lock
-		pthread_mutex_unlock(sv->mutex_lock);
-	}
+static void
+lru_hit(struct wc *wc, struct wc_item *item)
+{
+	(void)wc;
+	maintain_lru(item->tier->lru_queue, item, false);
 }
 
-void server_exit(struct server *sv)
+static void
+lru_policy_remove(struct wc *wc, struct wc_item *item)
 {
-	/* when using one or more worker threads, use sv->exiting to indicate to
-	 * these threads that the server is exiting. make sure to call
-	 * pthread_join in this function so that the main server thread waits
-	 * for all the worker threads to exit before exiting. */
-	sv->exiting = 1;
-	//printf("Sent exit command to threads!\n");
+	(void)wc;
+	lru_remove(item->tier->lru_queue, item);
+}
 
-	// Tell all threads to leave the worker loop
-	pthread_cond_broadcast(sv->empty);
+static struct wc_item *
+lru_victim(struct wc *wc, struct cache_tier *tier)
+{
+	(void)wc;
+	return least_recently_used_file(tier->lru_queue);
+}
 
-	// Join all threads
-	if (sv->nr_threads > 0)
-	{
+// clock: hits only set the referenced bit so the list is never relinked,
+// the hand sweeps from the tail towards the head giving referenced files
+// a second chance
+static void
+clock_hit(struct wc *wc, struct wc_item *item)
+{
+	(void)wc;
+	item->referenced = true;
+}
 
-		for (int i = 0; i < sv->nr_threads; i++)
-		{
-			pthread_join(*sv->workers[i], NULL);
-		}
-	}
+static void
+clock_remove(struct wc *wc, struct wc_item *item)
+{
+	struct cache_tier *tier = item->tier;
 
-	/* make sure to free any allocated resources */
-	if (sv->max_requests - 1 > 0)
+	(void)wc;
+	if (tier->clock_hand == item)
 	{
-		free(sv->buffer);
+		tier->clock_hand = item->lru_prev;
 	}
+	lru_remove(tier->lru_queue, item);
+}
 
-	// Free all the thread workers
-	if (sv->nr_threads > 0)
+static struct wc_item *
+clock_victim(struct wc *wc, struct cache_tier *tier)
+{
+	(void)wc;
+	while (tier->lru_queue->tail != NULL)
 	{
-		for (int i = 0; i < sv->nr_threads; i++)
+		// Wrap around to the tail
+		if (tier->clock_hand == NULL)
 		{
-			free(sv->workers[i]);
+			tier->clock_hand = tier->lru_queue->tail;
 		}
-		free(sv->workers);
-	}
 
-	// Free the cache...
-	if (sv->max_cache_size > 0)
-	{
-
-		for (int i = 0; i < sv->max_cache_size; i++)
+		struct wc_item *item = tier->clock_hand;
+		if (!item->referenced)
 		{
-			if (sv->cache->files[i] != NULL)
-			{
-				wc_item_destroy(sv, sv->cache->files[i]);
-			}
+			return item;
 		}
-		free(sv->cache->files);
+		item->referenced = false;
+		tier->clock_hand = item->lru_prev;
 	}
 
-	// Free locks and monitors...
-	free(sv->mutex_lock);
-	free(sv->full);
-	free(sv->empty);
-
-	free(sv);
+	return NULL;
 }
 
-//~~~~~ Implemented added functions ~~~~~
+// gdsf: priority = inflation + frequency / size, evict the lowest priority
+// and raise the inflation to it so old popular files eventually age out
+static void
+gdsf_swap(struct cache_tier *tier, long a, long b)
+{
+	struct wc_item *temp = tier->heap[a];
 
-// Have worker threads chill out here (blocked) until
-// the master thread signals for one of them to handle a request
-void stub_function(struct server *sv)
+	tier->heap[a] = tier->heap[b];
+	tier->heap[b] = temp;
+	tier->heap[a]->heap_index = a;
+	tier->heap[b]->heap_index = b;
+}
+
+static void
+gdsf_sift(struct cache_tier *tier, long index)
 {
-	// //printf("Thread arrived at stub!\n");
-	// Similar to the producer consumer problem, have threads wait until
-	// the buffer has an open spot before serving the request
+	// Up...
+	while (index > 0 && tier->heap[index]->priority < tier->heap[(index - 1) / 2]->priority)
+	{
+		gdsf_swap(tier, index, (index - 1) / 2);
+		index = (index - 1) / 2;
+	}
+
+	// ...and down
 	while (true)
 	{
-		// Obtain the lock...
-		pthread_mutex_lock(sv->mutex_lock);
-		// //printf("Obtained lock in stub_function\n");
+		long smallest = index;
+		long left = 2 * index + 1;
+		long right = 2 * index + 2;
 
-		// Wait for a signal while the buffer is empty
-		// Meaning that there are no more requests to be filled
-		// In server_request signal to a waiting thread that there is a new request (pthread_signal)
-		while ((sv->in - sv->out + sv->max_requests) % sv->max_requests == 0 && sv->exiting != 1)
+		if (left < tier->heap_count && tier->heap[left]->priority < tier->heap[smallest]->priority)
 		{
-			// //printf("In stub waiting on sv->empty\n");
-			pthread_cond_wait(sv->empty, sv->mutex_lock);
+			smallest = left;
 		}
-
-		int current_request = sv->buffer[sv->out];
-
-		// We know that the buffer is not empty
-		// However, if the buffer is full then then we have to make
-		// sure that those requests get processed...
-		// Let other threads know that the buffer is full
-		if ((sv->in - sv->out + sv->max_requests) % sv->max_requests == sv->max_requests - 1)
+		if (right < tier->heap_count && tier->heap[right]->priority < tier->heap[smallest]->priority)
 		{
-			// This goes to server_request...
-			// //printf("Sending signal sv->full\n");
-			pthread_cond_signal(sv->full);
+			smallest = right;
 		}
-
-		// Now that there is a request
-		// update the out index...
-		// Recall that the buffer is circular!
-		sv->out = (sv->out + 1) % sv->max_requests;
-		// //printf("Out: %d\n", sv->out);
-
-		// Release the lock
-		// //printf("Releasing lock in stub_function\n");
-		pthread_mutex_unlock(sv->mutex_lock);
-
-		// When the server calls sv->exiting then exit the thread
-		if (sv->exiting == 1)
+		if (smallest == index)
 		{
-			// //printf("Exiting thread!\n");
-			pthread_exit(NULL);
+			return;
 		}
-
-		// Finnaly do the actual request...
-		do_server_request(sv, current_request);
+		gdsf_swap(tier, index, smallest);
+		index = smallest;
 	}
 }
 
-//This hash function takes in a word and finds the index for where it belongs
-//Found online here: http://www.cse.yorku.ca/~oz/hash.html
-unsigned long hash_function(char *str, int max_table)
+static void
+gdsf_prioritize(struct cache_tier *tier, struct wc_item *item)
 {
-	unsigned long hash = 5381;
-	int c;
+	item->priority = tier->inflation + (double)item->frequency / (item->data->file_size + 1);
+}
 
-	//printf("Hashing for %s\n", str);
-	while ((c = *str++))
+static void
+gdsf_destroy(struct wc *wc)
+{
+	for (int i = 0; i < CACHE_TIERS; i++)
 	{
-		hash = ((hash << 5) + hash) + c;
-		/* hash * 33 + c */
+		free(wc->tiers[i].heap);
 	}
-
-	return hash % max_table;
 }
 
-//If we have a collision then insert a new link into the list...
-int collision_handler(struct server *sv, struct wc *table, struct wc_item *collision_word, unsigned long index)
+static void
+gdsf_insert(struct wc *wc, struct wc_item *item)
 {
-	//Go through the list of wc_items till the end or until
-	//we find a matching key
-	char *search_key = collision_word->key;
+	struct cache_tier *tier = item->tier;
 
-	struct wc_item *iterator = table->files[index];
-	while (iterator->next != NULL && strcmp(search_key, iterator->key) != 0)
+	(void)wc;
+	if (tier->heap_count == tier->heap_capacity)
 	{
-		iterator = iterator->next;
+		tier->heap_capacity = tier->heap_capacity > 0 ? tier->heap_capacity * 2 : 64;
+		tier->heap = (struct wc_item **)realloc(tier->heap, sizeof(struct wc_item *) * tier->heap_capacity);
 	}
 
-	//Now we've found the search key or found the end of the list...
-	if (strcmp(search_key, iterator->key) == 0)
+	// Still keep every file on the list so the cache can be walked in order
+	maintain_lru(tier->lru_queue, item, true);
+
+	gdsf_prioritize(tier, item);
+	item->heap_index = tier->heap_count;
+	tier->heap[tier->heap_count++] = item;
+	gdsf_sift(tier, item->heap_index);
+}
+
+static void
+gdsf_hit(struct wc *wc, struct wc_item *item)
+{
+	(void)wc;
+	item->frequency++;
+	gdsf_prioritize(item->tier, item);
+	gdsf_sift(item->tier, item->heap_index);
+}
+
+static void
+gdsf_remove(struct wc *wc, struct wc_item *item)
+{
+	struct cache_tier *tier = item->tier;
+	long index = item->heap_index;
+
+	(void)wc;
+	// Evicting the minimum raises the inflation value
+	if (index == 0)
 	{
-		return -1;
+		tier->inflation = item->priority;
 	}
-	else if (iterator->next == NULL)
+
+	tier->heap_count--;
+	if (index != tier->heap_count)
 	{
-		iterator->next = collision_word;
+		gdsf_swap(tier, index, tier->heap_count);
+		gdsf_sift(tier, index);
 	}
+	item->heap_index = -1;
+	lru_remove(tier->lru_queue, item);
+}
 
-	return 1;
+static struct wc_item *
+gdsf_victim(struct wc *wc, struct cache_tier *tier)
+{
+	(void)wc;
+	return tier->heap_count > 0 ? tier->heap[0] : NULL;
+}
+
+// tinylfu: lru eviction, but a new file is only let in if the sketch says
+// it's been asked for more often than the file it would replace
+#define SKETCH_ROWS 4
+
+static unsigned long
+sketch_index(struct frequency_sketch *sketch, unsigned long hash, int row)
+{
+	static const unsigned long seeds[SKETCH_ROWS] = {
+		0x9E3779B97F4A7C15ul, 0xC2B2AE3D27D4EB4Ful, 0x165667B19E3779F9ul, 0xD6E8FEB86659FD93ul};
+
+	hash = (hash ^ (hash >> 29)) * seeds[row];
+	return row * (sketch->width_mask + 1) + ((hash >> 32) & sketch->width_mask);
 }
 
-//This function DESTROYS (!) a wc_item recursively
-void wc_item_destroy(struct server *sv, struct wc_item *item)
+static void
+tinylfu_init(struct wc *wc)
 {
-	//Because it's bascially a linked list just get to the end of the chain
-	//then start freeing all the elements
-	if (item->next != NULL)
+	// Roughly one counter per 1KB of budget per row
+	unsigned long size = wc->tiers[TIER_SMALL].size + wc->tiers[TIER_LARGE].size;
+	unsigned long width = 256;
+	while (width < size / 1024 && width < (1ul << 20))
 	{
-		wc_item_destroy(sv, item->next);
+		width <<= 1;
 	}
 
-	// Want to make sure
-	sv->cache->count -= item->data->file_size;
-	free(item->key);
-	file_data_free(item->data);
-	free(item);
-	return;
+	wc->sketch = (struct frequency_sketch *)malloc(sizeof(struct frequency_sketch));
+	wc->sketch->width_mask = width - 1;
+	wc->sketch->counters = (unsigned char *)calloc(SKETCH_ROWS * width, 1);
+	wc->sketch->samples = 0;
+	wc->sketch->sample_limit = 10 * width;
 }
 
-// Look up a file in the cache
-struct wc_item *cache_lookup(struct server *sv, char *file_name)
+static void
+tinylfu_destroy(struct wc *wc)
 {
-	// Get the index into the cache array
-	unsigned long index = hash_function(file_name, sv->max_cache_size);
-	//printf("Hash index: %ld\n", index);
+	free(wc->sketch->counters);
+	free(wc->sketch);
+}
 
-	// Because we're using chaining go through a potential linked list
-	// until the correct file name is found
-	struct wc_item *iterator = sv->cache->files[index];
-	if (iterator != NULL)
+static void
+tinylfu_access(struct wc *wc, unsigned long hash)
+{
+	struct frequency_sketch *sketch = wc->sketch;
+
+	for (int row = 0; row < SKETCH_ROWS; row++)
 	{
-		while (iterator->next != NULL && strcmp(iterator->key, file_name) != 0)
+		unsigned char *counter = &sketch->counters[sketch_index(sketch, hash, row)];
+		if (*counter < UCHAR_MAX)
 		{
-			//printf("SEARCHING FOR KEY\n");
-			iterator = iterator->next;
+			(*counter)++;
 		}
 	}
 
-	if (iterator != NULL && strcmp(iterator->key, file_name) == 0)
+	// Halve everything once in a while so old popularity fades
+	if (++sketch->samples >= sketch->sample_limit)
 	{
-		//printf("Found file in cache! Key: %s, File: %s\n", iterator->key, file_name);
-
-		// Check if the file might be corrupted...
-		if (iterator->lru_next != NULL && strncmp("./fileset_dir/", iterator->lru_next->key, strlen("./fileset_dir/")) != 0)
+		for (unsigned long i = 0; i < SKETCH_ROWS * (sketch->width_mask + 1); i++)
 		{
-			//printf("Corrupted!\n");
-			struct wc_item *temp = iterator->lru_next;
-
-			if (temp->data != NULL)
-			{
-				file_data_free(temp->data);
-			}
-			free(temp->key);
-			free(temp);
-			temp = NULL;
-
-			iterator->lru_next = NULL;
+			sketch->counters[i] >>= 1;
 		}
-
-		// Update the lru
-		maintain_lru(sv->cache->lru_queue, iterator, false);
-		return iterator;
-	}
-	else
-	{
-		//printf("Not found in cache!\n");
-		return NULL;
+		sketch->samples /= 2;
 	}
 }
 
-// Try adding the file to the cache
-int cache_add(struct server *sv, struct file_data *data)
+static int
+tinylfu_estimate(struct frequency_sketch *sketch, unsigned long hash)
 {
-	// We know that the file isn't in the cache
-	unsigned long index = hash_function(data->file_name, sv->max_cache_size);
+	int estimate = UCHAR_MAX;
 
-	// For now simply insert it...
-	struct wc_item *new_file = (struct wc_item *)malloc(sizeof(struct wc_item));
-	new_file->key = (char *)malloc((strlen(data->file_name) + 1) * sizeof(char));
-	strcpy(new_file->key, data->file_name);
-	new_file->data = (struct file_data *)malloc(sizeof(struct file_data));
-	new_file->data = data;
-	new_file->next = NULL;
-	new_file->lru_next = NULL;
-	new_file->ref_bit = 0;
-	new_file->done_sending = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
-	pthread_cond_init(new_file->done_sending, NULL);
-
-	// Make sure that the cache has enough space
-	// if it does not then evict a file...
-	if (sv->cache->files[index] == NULL && (sv->cache->count + new_file->data->file_size) < sv->max_cache_size)
-	{
-		//printf("EZ insertion: %s\n", new_file->data->file_name);
-
-		// Add the file the hash table...
-		sv->cache->files[index] = (struct wc_item *)malloc(sizeof(struct wc_item));
-		sv->cache->files[index] = new_file;
-		sv->cache->count += new_file->data->file_size;
-
-		// Update the lru...
-		maintain_lru(sv->cache->lru_queue, new_file, true);
-		return 1;
-	}
-	else if (sv->cache->files[index] != NULL && (sv->cache->count + new_file->data->file_size) < sv->max_cache_size)
+	for (int row = 0; row < SKETCH_ROWS; row++)
 	{
-		//printf("Collision insertion! %s\n", new_file->data->file_name);
-
-		// Add the file to the hash table via chaining...
-		if (collision_handler(sv, sv->cache, new_file, index) == 1)
+		int counter = sketch->counters[sketch_index(sketch, hash, row)];
+		if (counter < estimate)
 		{
-			// Update the lru...
-			maintain_lru(sv->cache->lru_queue, new_file, true);
-			sv->cache->count += new_file->data->file_size;
+			estimate = counter;
 		}
-
-		return 1;
 	}
-	else
-	{
-		//Evict!
-		//printf("Evict a page! %s\n", new_file->key);
-		int evict_status = cache_evict(sv, new_file, index);
-
-		// Eviction was successful
-		if (evict_status == 1)
-		{
-			if (sv->cache->files[index] == NULL)
-			{
-
-				//printf("EZ insertion: %s\n", new_file->data->file_name);
+	return estimate;
+}
 
-				// Add the file the hash table...
-				sv->cache->files[index] = (struct wc_item *)malloc(sizeof(struct wc_item));
-				sv->cache->files[index] = new_file;
-				sv->cache->count += new_file->data->file_size;
-			}
-			else
-			{
-				//printf("Collision insertion! %s\n", new_file->data->file_name);
+static bool
+tinylfu_admit(struct wc *wc, struct wc_item *new_file, struct wc_item *victim)
+{
+	return tinylfu_estimate(wc->sketch, new_file->hash) > tinylfu_estimate(wc->sketch, victim->hash);
+}
 
-				// Add the file to the hash table via chaining...
-				if (collision_handler(sv, sv->cache, new_file, index) == 1)
-				{
-					// Update the lru...
-					maintain_lru(sv->cache->lru_queue, new_file, true);
-					sv->cache->count += new_file->data->file_size;
-				}
-			}
+static const struct cache_policy cache_policies[] = {
+	{"lru", NULL, NULL, NULL, lru_insert, lru_hit, lru_policy_remove, lru_victim, NULL},
+	{"clock", NULL, NULL, NULL, lru_insert, clock_hit, clock_remove, clock_victim, NULL},
+	{"gdsf", NULL, gdsf_destroy, NULL, gdsf_insert, gdsf_hit, gdsf_remove, gdsf_victim, NULL},
+	{"tinylfu", tinylfu_init, tinylfu_destroy, tinylfu_access, lru_insert, lru_hit, lru_policy_remove, lru_victim, tinylfu_admit},
+};
 
-			//printf("Successfully evicted and inserted!\n");
-			maintain_lru(sv->cache->lru_queue, new_file, true);
-			return 1;
-		}
-		// Eviction failed...
-		else if (evict_status == -1)
-		{
-			// free(new_file->key);
-			// free(new_file);
-			return -1;
-		}
-		// The file was found while you were trying to evict stuff
-		else
+// Find a policy by name, anything unknown gets lru
+const struct cache_policy *cache_policy_find(const char *name)
+{
+	for (size_t i = 0; i < sizeof(cache_policies) / sizeof(cache_policies[0]); i++)
+	{
+		if (strcmp(cache_policies[i].name, name) == 0)
 		{
-			free(new_file->key);
-			free(new_file->done_sending);
-			free(new_file);
-			return 2;
+			return &cache_policies[i];
 		}
 	}
+	return &cache_policies[0];
 }
 
-//Evict an item from the cache
-int cache_evict(struct server *sv, struct wc_item *new_file, int index)
+// Bytes a snapshot record takes up, padded so the next one is aligned
+static size_t
+snapshot_record_size(const struct snapshot_record *record)
 {
-	// Check if new_file got placed into the HT
-	if (sv->cache->files[index] != NULL && strcmp(sv->cache->files[index]->key, new_file->key) == 0)
-	{
-		//printf("Already inserted!\n");
-		return 2;
-	}
+	return (sizeof(struct snapshot_record) + record->key_len + record->file_size + 7) & ~7ul;
+}
 
-	//Find the least recently used file and evict it
-	//If the file is currently in use then wait for the file to be done being used
-	if (new_file->data->file_size > sv->max_cache_size)
+// Is a record's file still there and the same as when it was saved
+static bool
+snapshot_record_current(const struct snapshot_record *record, char *key, struct stat *st)
+{
+	return stat(key, st) == 0 && S_ISREG(st->st_mode) && st->st_size == record->file_size &&
+		   st->st_mtim.tv_sec == record->mtime_sec && st->st_mtim.tv_nsec == record->mtime_nsec;
+}
+
+// Write every cached file to path, least recently used first in each tier. The workers
+// are gone so no locks are needed. It's written to a temporary file and
+// renamed so a crash never leaves half a snapshot behind
+void cache_snapshot_save(struct server *sv, const char *path)
+{
+	char tmp_path[PATH_MAX];
+	static const char padding[8];
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	FILE *out = fopen(tmp_path, "w");
+	if (out == NULL)
 	{
-		// Make sure to free the new_file
-		//printf("File too big\n");
-		return -1;
+		return;
 	}
-	else
+
+	struct snapshot_header header = {SNAPSHOT_MAGIC, 0};
+	fwrite(&header, sizeof(header), 1, out);
+
+	for (int i = 0; i < sv->nr_shards * CACHE_TIERS; i++)
 	{
-		// Remove the least recently used file, and update the current size of the cache
-		// If there isn't enough space then DO IT AGAIN!
+		struct cache_tier *tier = &sv->cache[i / CACHE_TIERS].tiers[i % CACHE_TIERS];
 
-		// Get the LRU file
-		struct wc_item *to_be_evicted = sv->cache->lru_queue->head;
-		struct wc_item *new_end = NULL;
-		int retry = 0;
-		if (to_be_evicted != NULL)
+		for (struct wc_item *item = tier->lru_queue->tail; item != NULL; item = item->lru_prev)
 		{
-			while (to_be_evicted->lru_next != NULL)
-			{
-				new_end = to_be_evicted;
-				to_be_evicted = to_be_evicted->lru_next;
-			}
-
-			// If the file is currently in use then wait for it to be done...
-			//printf("To be evicted [%s]\n", to_be_evicted->key);
-			int n = to_be_evicted->ref_bit;
-			while (n > 0)
-			{
-				//printf("%s in use!\n", to_be_evicted->key);
-				pthread_cond_wait(to_be_evicted->done_sending, sv->mutex_cache_lock);
-				n = to_be_evicted->ref_bit;
-				retry++;
-			}
+			struct snapshot_record record;
 
-			// If another thread already evicted to_be_evicted then retry...
-			if (retry > 0)
-			{
-				// Check if another thread already added the file...
-				if (sv->cache->files[index] == NULL)
-				{
-					//printf("Retry!\n");
-					return cache_evict(sv, new_file, index);
-				}
-				// Otherwise it has already been serviced so leave
-				else
-				{
-					return -1;
-				}
-			}
-			// Otherwise delete that file and check if another needs to be deleted...
-			else
+			if (item->data == NULL)
 			{
-				if (new_end != NULL)
-				{
-					new_end->lru_next = to_be_evicted->lru_next;
-				}
-				else
-				{
-					// Front of lru just got evicted...
-					sv->cache->lru_queue->head = NULL;
-				}
-
-				cache_delete(sv, to_be_evicted, hash_function(to_be_evicted->data->file_name, sv->max_cache_size));
-
-				// If the cache is still not big enough then evict another item...
-				if ((sv->max_cache_size - sv->cache->count) < new_file->data->file_size)
-				{
-					return cache_evict(sv, new_file, index);
-				}
-				// If the cache is big enough then insert new_file into the hash table....
-				else
-				{
-					return 1;
-				}
+				continue;
 			}
+			record.key_len = strlen(item->key) + 1;
+			record.file_size = item->data->file_size;
+			record.mtime_sec = item->mtime.tv_sec;
+			record.mtime_nsec = item->mtime.tv_nsec;
+			fwrite(&record, sizeof(record), 1, out);
+			fwrite(item->key, record.key_len, 1, out);
+			fwrite(item->data->file_buf, record.file_size, 1, out);
+			fwrite(padding, snapshot_record_size(&record) - sizeof(record) - record.key_len - record.file_size, 1, out);
+			header.nr_records++;
 		}
 	}
 
-	//printf("Failed to_evicted != NULL\n");
-	return -1;
+	// Now that we know how many there are
+	rewind(out);
+	fwrite(&header, sizeof(header), 1, out);
+	int failed = ferror(out);
+	if (fclose(out) != 0 || failed)
+	{
+		unlink(tmp_path);
+		return;
+	}
+	rename(tmp_path, path);
 }
 
-// Delete a file from the cache!
-void cache_delete(struct server *sv, struct wc_item *to_be_deleted, int index)
+// Fill the (empty) cache from a snapshot, the most recently used files
+// that still fit go in, in their old order. Files whose size or mtime
+// changed since the snapshot are dropped
+void cache_snapshot_load(struct server *sv, const char *path)
 {
-	//printf("Deleting file!\n");
-	struct wc_item *iterator = sv->cache->files[index];
-	struct wc_item *previous = NULL;
+	int fd = open(path, O_RDONLY);
+	struct stat st;
 
-	// If the item is chained due to collisions find the previous and the actual
-	// pointer to to_be_deleted
-	while (iterator->next != NULL && strcmp(iterator->key, to_be_deleted->key) != 0)
+	if (fd < 0)
 	{
-		previous = iterator;
-		iterator = iterator->next;
+		return;
 	}
-
-	// Handle chaining...
-	if (previous != NULL)
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct snapshot_header))
 	{
-		previous->next = to_be_deleted->next;
+		close(fd);
+		return;
 	}
 
-	// Now free to_be_deleted...
-	sv->cache->count -= to_be_deleted->data->file_size;
-	sv->cache->files[index] = to_be_deleted->next;
-	free(to_be_deleted->key);
-	file_data_free(to_be_deleted->data);
-
-	if (previous == NULL && to_be_deleted->next == NULL)
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
 	{
-		free(sv->cache->files[index]);
-		sv->cache->files[index] = NULL;
-		assert(sv->cache->files[index] == NULL);
-	}
-	else
-	{
-		to_be_deleted->next = NULL;
-		to_be_deleted->lru_next = NULL;
-		free(to_be_deleted);
+		return;
 	}
-	return;
-}
-
-// Rearrange the lru to keep track of which file is the most recently used
-void maintain_lru(struct head_of_lru *lru_queue, struct wc_item *lru, bool new_file)
-{
 
-	struct wc_item *head = lru_queue->head;
-	// New list
-	if (head == NULL)
+	// A record count the file can't possibly hold means it's truncated or
+	// corrupt, and could be big enough to overflow the offsets array
+	struct snapshot_header *header = (struct snapshot_header *)map;
+	size_t max_records = (st.st_size - sizeof(struct snapshot_header)) / sizeof(struct snapshot_record);
+	size_t *offsets = NULL;
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->nr_records > max_records ||
+		(offsets = (size_t *)malloc(sizeof(size_t) * (header->nr_records + 1))) == NULL)
 	{
-		lru_queue->head = lru;
-		lru->lru_next = NULL;
+		munmap(map, st.st_size);
 		return;
 	}
 
-	// Move lru to the front of the queue, then rearrange the queue
-
-	// When has already been in the list...
-	// lru -> [KeyM] -> [Key(M+1)] ... -> [KeyN] -> END
-	// HEAD -> [Key1] -> [Key2] -> ... [KeyN] -> END
-	// HEAD -> [KeyM] -> [Key1] -> [Key2] -> ... [KeyN] -> END
-	if (lru->lru_next != NULL && !new_file)
+	// Find where every record starts, stopping at anything that runs off the end
+	size_t nr_records = 0;
+	size_t offset = sizeof(struct snapshot_header);
+	while (nr_records < header->nr_records && offset + sizeof(struct snapshot_record) <= (size_t)st.st_size)
 	{
-		// Check if lru is at the fron of the list...
-		if (strcmp(head->key, lru->key) == 0)
-		{
-			//Do nothing
-			return;
-		}
+		struct snapshot_record *record = (struct snapshot_record *)(map + offset);
+		char *key = (char *)(record + 1);
 
-		// Find the previous node
-		//printf("Middle maintain %s\n", lru->key);
-		struct wc_item *iterator = head;
-		while (iterator->lru_next != NULL && strcmp(iterator->lru_next->key, lru->key) != 0)
+		if (record->key_len == 0 || offset + snapshot_record_size(record) > (size_t)st.st_size ||
+			key[record->key_len - 1] != '\0')
 		{
-			iterator = iterator->lru_next;
+			break;
 		}
-
-		iterator->lru_next = lru->lru_next;
-		lru->lru_next = head;
-		lru_queue->head = lru;
-		return;
+		offsets[nr_records++] = offset;
+		offset += snapshot_record_size(record);
 	}
-	// When lru is a newly added element or end of the list...
-	else
+
+	// Pick files from the most recently used back until each tier is full,
+	// the ones picked keep their offset and the rest get 0
+	long *used = (long *)calloc(sv->nr_shards * CACHE_TIERS, sizeof(long));
+	for (size_t i = nr_records; i-- > 0;)
 	{
-		// If the file is new then it's pretty simple...
-		// lru -> [KeyM] -> END
-		// HEAD -> [Key1] -> [Key2] -> ... [KeyN] -> END
-		// HEAD -> [KeyM] -> [Key1] -> [Key2] -> ... [KeyN] -> END
-		if (new_file)
+		struct snapshot_record *record = (struct snapshot_record *)(map + offsets[i]);
+		char *key = (char *)(record + 1);
+		struct wc *shard = cache_shard(sv, hash_string(key));
+		struct cache_tier *tier = cache_tier_for(shard, record->file_size);
+		long *tier_used = &used[(shard - sv->cache) * CACHE_TIERS + (tier - shard->tiers)];
+		char header[RESPONSE_HEADER_MAX];
+		int header_len = response_header_start(header, sizeof(header), key, record->file_size);
+		long charge = tier == &shard->tiers[TIER_SMALL]
+						  ? arena_charge(wc_item_inline_size(key, header_len, record->file_size))
+						  : arena_charge(wc_item_size(key)) + arena_charge(header_len) + arena_charge(record->file_size);
+		struct stat file_st;
+
+		if (!snapshot_record_current(record, key, &file_st))
 		{
-			//printf("New file maintain\n");
-			lru->lru_next = head;
-			lru_queue->head = lru;
-			return;
+			sv->snapshot_stale++;
+			offsets[i] = 0;
+		}
+		else if (tier->count + *tier_used + charge > tier->size)
+		{
+			offsets[i] = 0;
 		}
-		// Otherwise the file is at the end of the list...
-		// lru -> [KeyM] -> END
-		// HEAD -> [Key1] -> [Key2] -> ... [KeyM] -> END
-		// HEAD -> [KeyM] -> [Key1] -> [Key2] -> ... [Key(M-1)] -> END
 		else
 		{
+			*tier_used += charge;
+		}
+	}
+	free(used);
 
-			// Edge case where the list is one element long
-			// Do nothing
-			// HEAD - > [Key1] -> END
-			//printf("End case maintain\n");
-			if (strcmp(head->key, lru->key) == 0)
-			{
-				lru->lru_next = NULL;
-				return;
-			}
+	// Then put them in oldest first so the lru ends up the way it was
+	for (size_t i = 0; i < nr_records; i++)
+	{
+		if (offsets[i] == 0)
+		{
+			continue;
+		}
 
-			struct wc_item *iterator = head;
-			struct wc_item *previous = NULL;
-			while (iterator->lru_next != NULL && strcmp(iterator->lru_next->key, lru->key) != 0)
-			{
-				previous = iterator;
-				iterator = iterator->lru_next;
-			}
+		struct snapshot_record *record = (struct snapshot_record *)(map + offsets[i]);
+		char *key = (char *)(record + 1);
+		unsigned long hash = hash_string(key);
+		struct wc *shard = cache_shard(sv, hash);
+		struct file_data data = {key, NULL, record->file_size};
+		struct stat file_st;
 
-			if (previous != NULL)
+		if (cache_find(shard, key, hash) != NULL)
+		{
+			continue;
+		}
+
+		// Watch it first and look again, it could have changed since
+		cache_watch_add(sv, key);
+		if (!snapshot_record_current(record, key, &file_st))
+		{
+			sv->snapshot_stale++;
+			continue;
+		}
+		struct wc_item *item = cache_reserve(shard, key, hash);
+		data.file_buf = arena_alloc(&shard->arena, data.file_size);
+		if (item == NULL || data.file_buf == NULL)
+		{
+			if (data.file_buf != NULL)
 			{
-				iterator->lru_next = lru->lru_next;
-				lru->lru_next = head;
-				lru_queue->head = lru;
+				arena_free(&shard->arena, data.file_buf, data.file_size);
 			}
-			// Two item linked list edge case....
-			else
+			if (item != NULL)
 			{
-				lru_queue->head = lru;
+				cache_abandon(shard, item);
 			}
+			break;
+		}
+
+		memcpy(data.file_buf, key + record->key_len, data.file_size);
+		cache_identify(item, &file_st);
+		if (cache_add(shard, item, &data) == 1)
+		{
+			sv->snapshot_restored++;
+			cache_release(item);
+		}
+		else
+		{
+			arena_free(&shard->arena, data.file_buf, data.file_size);
 		}
 	}
 
-	return;
+	free(offsets);
+	munmap(map, st.st_size);
 }
 
 // Print the cache for debugging
 void print_cache(struct wc *wc)
 {
-	//Just go through the hash array and output the word and the repetitions...
+	//Just go through the index and output the files and their sizes...
 	int cache_size = 0;
 	//printf("{\n");
-	for (int i = 0; i < wc->size; i++)
+	for (unsigned long i = 0; i <= wc->index.mask; i++)
 	{
-		if (wc->files[i] != NULL)
+		struct wc_item *iterator = wc->index.slots[i].item;
+		if (iterator != NULL && iterator->data != NULL)
 		{
-			struct wc_item *iterator = wc->files[i];
-			while (iterator != NULL)
-			{
-				//printf("(%d) %s : %d,\n", i, iterator->key, iterator->data->file_size);
-				cache_size += iterator->data->file_size;
-				iterator = iterator->next;
-			}
+			//printf("(%lu) %s : %d,\n", i, iterator->key, iterator->data->file_size);
+			cache_size += iterator->data->file_size;
 		}
 	}
 	//printf("\n}");
-	//printf("\nCache Capacity: %ld\nCurrent Size: %ld\n", wc->size, wc->count);
+	//printf("\nCache Capacity: %ld\nCurrent Size: %ld\nPolicy: %s\n", wc->size, wc->count, wc->policy->name);
 	return;
 }
 
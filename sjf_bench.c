@@ -0,0 +1,308 @@
+// Compares the fifo and sjf schedulers on the same made up load, to see what
+// shortest job first does to the latency of small requests stuck behind big
+// downloads. Like cache_sim it includes server_thread.c, the sjf side goes
+// through the server's own scheduler_key, scheduler_push and scheduler_pop
+// with the sizes coming out of its cache. Time is simulated, a request takes
+// BENCH_SERVICE_NS plus BENCH_NS_PER_BYTE for every byte it sends, so the
+// numbers only depend on the arguments. fifo is one queue in arrival order,
+// which is what the per-worker rings with stealing come close to. Build it with
+//
+//     gcc -O2 -pthread -o sjf_bench sjf_bench.c request.c common.c -lm
+//
+// and run it with -w workers -l load (0 to 1) -n requests -b big_percent
+// -B big_size -m max_wait_us -s seed, all optional
+#include "server_thread.c"
+#include <getopt.h>
+#include <math.h>
+
+// What a request costs apart from its bytes, and what every byte costs
+#define BENCH_SERVICE_NS 20000l
+#define BENCH_NS_PER_BYTE 1
+
+// Small files are 1KB to BENCH_SMALL_MAX, there's one big one
+#define BENCH_SMALL_FILES 1000
+#define BENCH_SMALL_MAX (16 * 1024)
+
+// One request of the load and when it was answered
+struct bench_request
+{
+	long arrival;
+	char *file_name;
+	int file_size;
+	long finish;
+};
+
+// Every "open" file is a copy of /dev/null so server_fetch can close it
+static int bench_null_fd;
+
+void usage()
+{
+	fprintf(stderr, "Usage: sjf_bench [-w workers] [-l load] [-n requests] [-b big_percent]\n"
+					"                 [-B big_size] [-m max_wait_us] [-s seed]\n");
+	exit(1);
+}
+
+// splitmix64, the same seed gives the same load everywhere
+static unsigned long
+bench_random(unsigned long *state)
+{
+	unsigned long z = (*state += 0x9E3779B97F4A7C15ul);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ul;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBul;
+	return z ^ (z >> 31);
+}
+
+// Uniform in (0, 1)
+static double
+bench_uniform(unsigned long *state)
+{
+	return ((bench_random(state) >> 11) + 0.5) / (double)(1ul << 53);
+}
+
+static int
+bench_openfile(struct file_data *data, struct stat *st)
+{
+	if (st != NULL)
+	{
+		memset(st, 0, sizeof(struct stat));
+		st->st_mode = S_IFREG;
+		st->st_size = data->file_size;
+	}
+	return dup(bench_null_fd);
+}
+
+static int
+bench_readfile(int fd, struct file_data *data)
+{
+	(void)fd;
+	(void)data;
+	return 1;
+}
+
+static long
+bench_service(struct bench_request *request)
+{
+	return BENCH_SERVICE_NS + request->file_size * BENCH_NS_PER_BYTE;
+}
+
+// Play the load through nr_workers workers, taking requests in arrival order
+// or from the sjf heap. A worker that frees up takes the next request right
+// away, one that's idle takes an arriving one as it comes in
+static void
+bench_run(struct server *sv, struct bench_request *requests, long nr_requests, int nr_workers, bool sjf)
+{
+	long *free_at = (long *)calloc(nr_workers, sizeof(long));
+	long next_arrival = 0;
+	long next_fifo = 0;
+	long queued = 0;
+
+	while (next_arrival < nr_requests || queued > 0)
+	{
+		int worker = 0;
+		for (int i = 1; i < nr_workers; i++)
+		{
+			if (free_at[i] < free_at[worker])
+			{
+				worker = i;
+			}
+		}
+
+		// Everything that arrives before the first worker is free is queued first
+		if (next_arrival < nr_requests && (queued == 0 || requests[next_arrival].arrival <= free_at[worker]))
+		{
+			struct bench_request *request = &requests[next_arrival];
+			if (sjf)
+			{
+				struct work_item item = {(int)next_arrival, request->arrival, NULL, 0};
+				item.key = scheduler_key(sv, request->file_name, request->arrival);
+				scheduler_push(sv, &item);
+			}
+			next_arrival++;
+			queued++;
+			continue;
+		}
+
+		struct bench_request *request;
+		if (sjf)
+		{
+			struct work_item item;
+			scheduler_pop(sv, &item);
+			request = &requests[item.connfd];
+		}
+		else
+		{
+			request = &requests[next_fifo++];
+		}
+		queued--;
+
+		long start = request->arrival > free_at[worker] ? request->arrival : free_at[worker];
+		request->finish = start + bench_service(request);
+		free_at[worker] = request->finish;
+	}
+	free(free_at);
+}
+
+static void
+bench_report(const char *name, struct bench_request *requests, long nr_requests)
+{
+	struct histogram *all = (struct histogram *)calloc(1, sizeof(struct histogram));
+	struct histogram *small = (struct histogram *)calloc(1, sizeof(struct histogram));
+	struct histogram *big = (struct histogram *)calloc(1, sizeof(struct histogram));
+
+	for (long i = 0; i < nr_requests; i++)
+	{
+		long latency = requests[i].finish - requests[i].arrival;
+
+		histogram_record(all, latency);
+		histogram_record(requests[i].file_size <= BENCH_SMALL_MAX ? small : big, latency);
+	}
+
+	struct histogram *histograms[] = {all, small, big};
+	const char *kinds[] = {"all", "small", "big"};
+	for (int i = 0; i < 3; i++)
+	{
+		struct histogram *histogram = histograms[i];
+		printf("%-6s %-6s %9lu %9lu %9lu %9lu %9lu %9lu\n", name, kinds[i], histogram->total,
+			   histogram->total > 0 ? histogram->sum / histogram->total / 1000 : 0,
+			   histogram_percentile(histogram, 50) / 1000, histogram_percentile(histogram, 99) / 1000,
+			   histogram_percentile(histogram, 99.9) / 1000, histogram->max / 1000);
+	}
+	free(all);
+	free(small);
+	free(big);
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_workers = 4;
+	double load = 0.8;
+	long nr_requests = 200000;
+	double big_percent = 2;
+	long big_size = 5 << 20;
+	long max_wait_us = SCHEDULER_MAX_WAIT_US;
+	unsigned long seed = 1;
+	int option;
+
+	while ((option = getopt(argc, argv, "w:l:n:b:B:m:s:")) != -1)
+	{
+		switch (option)
+		{
+		case 'w':
+			nr_workers = atoi(optarg);
+			break;
+		case 'l':
+			load = atof(optarg);
+			break;
+		case 'n':
+			nr_requests = atol(optarg);
+			break;
+		case 'b':
+			big_percent = atof(optarg);
+			break;
+		case 'B':
+			big_size = atol(optarg);
+			break;
+		case 'm':
+			max_wait_us = atol(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nr_workers < 1 || load <= 0 || load >= 1 || nr_requests < 1 || nr_requests > INT_MAX || big_percent < 0 ||
+		big_percent > 100 || big_size <= BENCH_SMALL_MAX || big_size > (1 << 30) || max_wait_us < 0 || optind != argc)
+	{
+		usage();
+	}
+
+	// Just the cache, in one piece big enough for every file so all sizes are known
+	setenv("SERVER_CACHE_SHARDS", "1", 1);
+	setenv("SERVER_CACHE_WATCH", "0", 1);
+	setenv("SERVER_CACHE_REVALIDATE_MS", "0", 1);
+	setenv("SERVER_CACHE_SNAPSHOT", "", 1);
+	setenv("SERVER_EVENT_LOOPS", "0", 1);
+	setenv("SERVER_CACHE_SMALL_PERCENT", "0", 1);
+	bench_null_fd = open("/dev/null", O_RDONLY);
+	if (bench_null_fd < 0)
+	{
+		fprintf(stderr, "sjf_bench: can't open /dev/null\n");
+		exit(1);
+	}
+	struct server *sv = server_init(0, 0, big_size * 2 + (64 << 20));
+	sv->open_file = bench_openfile;
+	sv->read_file = bench_readfile;
+
+	// With no workers server_init leaves the heap out, it has to hold
+	// everything that could be queued at once
+	sv->sjf = true;
+	sv->sjf_max_wait_ns = max_wait_us * 1000;
+	sv->sjf_heap = (struct work_item *)Malloc(sizeof(struct work_item) * nr_requests);
+
+	char *names[BENCH_SMALL_FILES + 1];
+	int sizes[BENCH_SMALL_FILES + 1];
+	unsigned long state = seed;
+	for (int i = 0; i <= BENCH_SMALL_FILES; i++)
+	{
+		char name[32];
+		if (i < BENCH_SMALL_FILES)
+		{
+			snprintf(name, sizeof(name), "small/f%04d", i);
+			sizes[i] = 1024 + (int)(bench_random(&state) % (BENCH_SMALL_MAX - 1024));
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "big");
+			sizes[i] = big_size;
+		}
+		names[i] = strdup(name);
+
+		struct file_data data = {names[i], NULL, sizes[i]};
+		struct wc_item *cached_file;
+		int fd;
+		if (server_fetch(sv, &data, &cached_file, &fd) == FETCH_STREAM)
+		{
+			close(fd);
+		}
+		server_fetch_done(sv, &data, cached_file);
+	}
+
+	// Poisson arrivals that keep the workers busy load of the time
+	double mean_service = BENCH_SERVICE_NS + BENCH_NS_PER_BYTE * (big_percent / 100 * big_size +
+																  (1 - big_percent / 100) * (1024 + BENCH_SMALL_MAX) / 2);
+	double mean_gap = mean_service / nr_workers / load;
+	struct bench_request *requests = (struct bench_request *)malloc(sizeof(struct bench_request) * nr_requests);
+	double now = 0;
+	for (long i = 0; i < nr_requests; i++)
+	{
+		int file = bench_uniform(&state) * 100 < big_percent ? BENCH_SMALL_FILES
+															 : (int)(bench_random(&state) % BENCH_SMALL_FILES);
+		now += -log(bench_uniform(&state)) * mean_gap;
+		requests[i].arrival = (long)now;
+		requests[i].file_name = names[file];
+		requests[i].file_size = sizes[file];
+		requests[i].finish = 0;
+	}
+
+	printf("workers %d load %.2f requests %ld big %.1f%% of %ldB max_wait %ldus\n",
+		   nr_workers, load, nr_requests, big_percent, big_size, max_wait_us);
+	printf("%-6s %-6s %9s %9s %9s %9s %9s %9s\n", "order", "size", "count", "mean_us", "p50_us", "p99_us", "p999_us",
+		   "max_us");
+	bench_run(sv, requests, nr_requests, nr_workers, false);
+	bench_report("fifo", requests, nr_requests);
+	bench_run(sv, requests, nr_requests, nr_workers, true);
+	bench_report("sjf", requests, nr_requests);
+	printf("sjf sizes known %lu guessed %lu\n", stats_self(sv)->sjf_known, stats_self(sv)->sjf_guessed);
+
+	free(requests);
+	for (int i = 0; i <= BENCH_SMALL_FILES; i++)
+	{
+		free(names[i]);
+	}
+	server_exit(sv);
+	close(bench_null_fd);
+	return 0;
+}